@@ -0,0 +1,428 @@
+// Measures how long it takes to set up a with namespace, without needing
+// root: everything runs in a user+mount namespace of our own, in which we're
+// root and can mount the tmpfs on /with the helper wants to replace.
+//
+// usage: bench_ns [iterations [creators...]]
+//   for every combination of target count (10 to 10000), nesting depth and
+//   environment size, runs <iterations> setups in each of <creators>
+//   concurrent threads (default: 1 and 4), and prints p50/p99 latency:
+//     build   build_tree() into a fresh tmpfs, which is what the helper
+//             spends on a namespace after the tmpfs is mounted
+//     helper  the whole helper path: fork, execve of exec_with_namespace
+//             --spec-fd, unshare, mounts, metadata, symlinks and the execve
+//             of /bin/true
+//     cached  the same, with a WITH_CACHE_DIR to keep prebuilt trees in
+//             (only if this machine has one for us to mount over)
+//   and how many syscalls it takes: from ns_build_stats for build (with
+//   what mkdir_p and symlink on whole paths would take in parens), and by
+//   tracing one run of the helper from its execve to its execvp for the
+//   others.
+//
+// BENCH_HELPER names the helper to run (default ./exec_with_namespace).
+// /with must exist; on a machine with with installed it does.
+
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "exec.hpp"
+#include "exec_defs.hpp"
+#include "exec_spec.hpp"
+#include "ns_builder.hpp"
+
+// where the build path makes its trees; a tmpfs in our namespace only
+static char scratchDir[] = "/tmp/with-bench.XXXXXX";
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void writeFile(const char *path, const char *contents)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd < 0)
+        throw failure("open %s failed: %m", path);
+    ssize_t len = write(fd, contents, strlen(contents));
+    close(fd);
+    if(len != ssize_t(strlen(contents)))
+        throw failure("write %s failed: %m", path);
+}
+
+// becomes root in a new user namespace (unless we already are root) and a
+// new mount namespace, with fresh tmpfses on /with, the scratch directory
+// and the cache directory, if there is one. Returns whether there is.
+static bool enterBenchNamespace()
+{
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    if(unshare(uid == 0 ? CLONE_NEWNS : CLONE_NEWUSER | CLONE_NEWNS) != 0)
+        throw failure("unshare failed: %m (are unprivileged user namespaces disabled?)");
+    if(uid != 0)
+    {
+        char map[64];
+        writeFile("/proc/self/setgroups", "deny");
+        snprintf(map, sizeof(map), "0 %d 1", int(uid));
+        writeFile("/proc/self/uid_map", map);
+        snprintf(map, sizeof(map), "0 %d 1", int(gid));
+        writeFile("/proc/self/gid_map", map);
+    }
+    if(mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0)
+        throw failure("making / private failed: %m");
+
+    struct stat st;
+    if(stat(WITH_MOUNTPOINT, &st) != 0)
+        throw failure(WITH_MOUNTPOINT " is missing: %m");
+    if(mount("with-bench", WITH_MOUNTPOINT, "tmpfs", 0, NULL) != 0)
+        throw failure("mount tmpfs " WITH_MOUNTPOINT " failed: %m");
+
+    if(!mkdtemp(scratchDir) || mount("with-bench", scratchDir, "tmpfs", 0, NULL) != 0)
+        throw failure("mount tmpfs %s failed: %m", scratchDir);
+
+    // private, like the init script makes it (and like everything else
+    // here, now that / is)
+    return stat(WITH_CACHE_DIR, &st) == 0
+        && mount("with-bench", WITH_CACHE_DIR, "tmpfs", 0, "mode=0755") == 0;
+}
+
+struct Config
+{
+    int m_targets, m_depth, m_envVars;
+    std::vector<std::string> m_targetArgs, m_env;
+    std::string m_spec;
+
+    // spreads m_targets links over m_depth levels of directories with the
+    // same fan-out at every level
+    void generate()
+    {
+        int fanout = 1;
+        while(m_depth > 1 && pow(fanout, m_depth - 1) * fanout < m_targets)
+            ++fanout;
+
+        char buf[64];
+        for(int i = 0; i < m_targets; ++i)
+        {
+            std::string target;
+            for(int level = m_depth - 2, rest = i / fanout; level >= 0; --level, rest /= fanout)
+            {
+                snprintf(buf, sizeof(buf), "d%d_%d/", level, rest % fanout);
+                target.insert(0, buf);
+            }
+            snprintf(buf, sizeof(buf), "t%d=/usr/lib/bench/%d", i, i);
+            m_targetArgs.push_back(target + buf);
+        }
+        for(int i = 0; i < m_envVars; ++i)
+        {
+            snprintf(buf, sizeof(buf), "BENCH_VAR_%d=", i);
+            m_env.push_back(buf + std::string(100, 'x'));
+        }
+        m_env.push_back("PATH=/usr/bin:/bin");
+
+        spec_writer spec;
+        spec.add_section(std::vector<std::string>(1, "/bin/true"));
+        spec.add_section(std::vector<std::string>(1, "with-bench"));
+        spec.add_section(m_targetArgs);
+        spec.add_section(m_env);
+        m_spec = spec.finish();
+    }
+
+    static long pow(long base, int exp)
+    {
+        long ret = 1;
+        while(exp-- > 0)
+            ret *= base;
+        return ret;
+    }
+};
+
+enum Path { BUILD, HELPER, CACHED };
+static const char *pathNames[] = { "build", "helper", "cached" };
+
+struct Creator
+{
+    const Config *m_config;
+    Path m_path;
+    std::string m_helper;
+    int m_id, m_iterations;
+    std::vector<double> m_latencies;
+    ns_build_stats m_stats;
+    std::string m_error;
+
+    // one build_tree() into a tmpfs of its own
+    void build(int iteration)
+    {
+        char dir[128];
+        snprintf(dir, sizeof(dir), "%s/%d-%d", scratchDir, m_id, iteration);
+        if(mkdir(dir, 0755) != 0 || mount("with-bench", dir, "tmpfs", 0, NULL) != 0)
+            throw failure("mount tmpfs %s failed: %m", dir);
+        int fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if(fd < 0)
+            throw failure("open %s failed: %m", dir);
+
+        std::vector<char *> targets;
+        for(size_t i = 0; i < m_config->m_targetArgs.size(); ++i)
+            targets.push_back(const_cast<char *>(m_config->m_targetArgs[i].c_str()));
+        ns_build_stats stats;
+        double start = now();
+        int ret = build_tree("bench_ns", fd, targets, stats);
+        m_latencies.push_back(now() - start);
+        m_stats = stats;
+
+        close(fd);
+        umount2(dir, MNT_DETACH);
+        rmdir(dir);
+        if(ret != 0)
+            throw failure("build_tree failed");
+    }
+
+    // one run of the helper, the way with_exec_c runs it
+    void helper()
+    {
+        int fd = makeSpecFD(m_config->m_spec);
+        char arg[32];
+        snprintf(arg, sizeof(arg), "--spec-fd=%d", fd);
+        const char *argv[] = { m_helper.c_str(), arg, NULL };
+        char *envp[] = { NULL };
+
+        double start = now();
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            fcntl(fd, F_SETFD, 0);
+            execve(argv[0], const_cast<char **>(argv), envp);
+            _exit(127);
+        }
+        close(fd);
+        int status;
+        if(pid < 0 || waitpid(pid, &status, 0) != pid)
+            throw failure("running %s failed: %m", argv[0]);
+        m_latencies.push_back(now() - start);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            throw failure("%s failed with status %d", argv[0], status);
+    }
+
+    void run()
+    {
+        try
+        {
+            for(int i = 0; i < m_iterations; ++i)
+            {
+                if(m_path == BUILD)
+                    build(i);
+                else
+                    helper();
+            }
+        }
+        catch(failure &f)
+        {
+            m_error = f.what();
+        }
+    }
+
+    static void *thread(void *arg)
+    {
+        static_cast<Creator *>(arg)->run();
+        return NULL;
+    }
+
+    static int makeSpecFD(const std::string &spec)
+    {
+        int fd = memfd_create("with-spec", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if(fd < 0 || write(fd, spec.data(), spec.size()) != ssize_t(spec.size())
+            || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+            throw failure("making spec memfd failed: %m");
+        return fd;
+    }
+};
+
+// the syscalls the helper makes between being exec'ed and exec'ing the
+// command, or -1 if we can't trace it
+static long countHelperSyscalls(const Config &config, const std::string &helperPath)
+{
+    int fd = Creator::makeSpecFD(config.m_spec);
+    char arg[32];
+    snprintf(arg, sizeof(arg), "--spec-fd=%d", fd);
+    const char *argv[] = { helperPath.c_str(), arg, NULL };
+    char *envp[] = { NULL };
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        fcntl(fd, F_SETFD, 0);
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execve(argv[0], const_cast<char **>(argv), envp);
+        _exit(127);
+    }
+    close(fd);
+    if(pid < 0)
+        return -1;
+
+    int status;
+    if(waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)
+        || ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL) != 0)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    // every syscall stops twice, on the way in and out; the execve into the
+    // helper is the first exec event, the one into the command the second
+    long stops = 0;
+    int execs = 0;
+    int sig = 0;
+    while(ptrace(execs < 2 ? PTRACE_SYSCALL : PTRACE_CONT, pid, NULL, (void *)(long)sig) == 0
+        && waitpid(pid, &status, 0) == pid && WIFSTOPPED(status))
+    {
+        sig = 0;
+        if(status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8)))
+            ++execs;
+        else if(WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops += execs == 1;
+        else
+            sig = WSTOPSIG(status);
+    }
+    while(!WIFEXITED(status) && !WIFSIGNALED(status) && waitpid(pid, &status, 0) == pid)
+        ;
+    return execs == 2 ? stops / 2 : -1;
+}
+
+static double percentile(std::vector<double> &samples, int pct)
+{
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, samples.size() * pct / 100)];
+}
+
+// runs config along path in creators threads and prints a line about it
+static void bench(const Config &config, Path path, int creators, int iterations, const std::string &helper,
+    long helperSyscalls)
+{
+    std::vector<Creator> threads(creators);
+    for(int i = 0; i < creators; ++i)
+    {
+        threads[i].m_config = &config;
+        threads[i].m_path = path;
+        threads[i].m_helper = helper;
+        threads[i].m_id = i;
+        threads[i].m_iterations = iterations;
+    }
+    std::vector<pthread_t> tids(creators);
+    for(int i = 0; i < creators; ++i)
+    {
+        if(pthread_create(&tids[i], NULL, &Creator::thread, &threads[i]) != 0)
+            throw failure("pthread_create failed");
+    }
+    std::vector<double> latencies;
+    for(int i = 0; i < creators; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        if(!threads[i].m_error.empty())
+            throw failure("%s", threads[i].m_error.c_str());
+        latencies.insert(latencies.end(), threads[i].m_latencies.begin(), threads[i].m_latencies.end());
+    }
+
+    char syscalls[64] = "-";
+    if(path == BUILD)
+        snprintf(syscalls, sizeof(syscalls), "%lu (%lu)", threads[0].m_stats.m_syscalls,
+            threads[0].m_stats.m_path_syscalls);
+    else if(helperSyscalls >= 0)
+        snprintf(syscalls, sizeof(syscalls), "%ld", helperSyscalls);
+
+    printf("%-7s %8d %6d %6d %9d %10.1f %10.1f %16s\n", pathNames[path], config.m_targets, config.m_depth,
+        config.m_envVars, creators, percentile(latencies, 50) * 1e6, percentile(latencies, 99) * 1e6, syscalls);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    std::vector<int> creators;
+    for(int i = 2; i < argc; ++i)
+        creators.push_back(atoi(argv[i]));
+    if(creators.empty())
+    {
+        creators.push_back(1);
+        creators.push_back(4);
+    }
+    const char *helper = getenv("BENCH_HELPER") ? getenv("BENCH_HELPER") : "./exec_with_namespace";
+    char helperPath[PATH_MAX];
+    if(iterations <= 0 || !realpath(helper, helperPath))
+    {
+        fprintf(stderr, "usage: %s [iterations [creators...]]\n"
+            "    BENCH_HELPER=%s must exist\n", argv[0], helper);
+        return 1;
+    }
+
+    static const int targetCounts[] = { 10, 100, 1000, 10000 };
+    static const int depths[] = { 1, 4 };
+    static const int envSizes[] = { 0, 1000 };
+
+    int ret = 0;
+    try
+    {
+        bool haveCache = enterBenchNamespace();
+        printf("%-7s %8s %6s %6s %9s %10s %10s %16s\n", "path", "targets", "depth", "env", "creators",
+            "p50(us)", "p99(us)", "syscalls");
+        for(size_t t = 0; t < sizeof(targetCounts) / sizeof(targetCounts[0]); ++t)
+        {
+            for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+            {
+                for(size_t e = 0; e < sizeof(envSizes) / sizeof(envSizes[0]); ++e)
+                {
+                    Config config;
+                    config.m_targets = targetCounts[t];
+                    config.m_depth = depths[d];
+                    config.m_envVars = envSizes[e];
+                    config.generate();
+
+                    // a cache directory anyone can write to is one the helper won't use
+                    if(haveCache && chmod(WITH_CACHE_DIR, 0777) != 0)
+                        throw failure("chmod " WITH_CACHE_DIR " failed: %m");
+                    long helperSyscalls = countHelperSyscalls(config, helperPath);
+                    for(size_t c = 0; c < creators.size(); ++c)
+                    {
+                        bench(config, BUILD, creators[c], iterations, helperPath, -1);
+                        bench(config, HELPER, creators[c], iterations, helperPath, helperSyscalls);
+                    }
+                    if(!haveCache)
+                        continue;
+
+                    if(chmod(WITH_CACHE_DIR, 0755) != 0)
+                        throw failure("chmod " WITH_CACHE_DIR " failed: %m");
+                    // the first run builds the tree; count one that uses it
+                    countHelperSyscalls(config, helperPath);
+                    long cachedSyscalls = countHelperSyscalls(config, helperPath);
+                    for(size_t c = 0; c < creators.size(); ++c)
+                        bench(config, CACHED, creators[c], iterations, helperPath, cachedSyscalls);
+                }
+            }
+        }
+    }
+    catch(failure &f)
+    {
+        fprintf(stderr, "%s: %s\n", argv[0], f.what());
+        ret = 1;
+    }
+    if(umount2(scratchDir, MNT_DETACH) == 0)
+        rmdir(scratchDir);
+    return ret;
+}
@@ -0,0 +1,86 @@
+// Compares the fork+exec and posix_spawn paths of daemon_pipe for callers
+// with a large resident set, like a Lua interpreter with a big heap.
+//
+// usage: bench_spawn [pipelines [stages [rss-mb...]]]
+//   runs <pipelines> daemon_pipes of <stages> /bin/true procs each, for each
+//   resident set size (default: 0, 100 and 1024 MB), with both spawn paths.
+
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "pipe.hpp"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// runs the pipelines and returns the average microseconds per proc
+static double run(int pipelines, int stages, bool useFork)
+{
+    double start = now();
+    for(int i = 0; i < pipelines; ++i)
+    {
+        daemon_pipe dp;
+        dp.m_useFork = useFork;
+        for(int j = 0; j < stages; ++j)
+        {
+            daemon_proc_spec_ptr proc(new daemon_proc_spec);
+            proc->m_cmdArgv.push_back("/bin/true");
+            dp.add_proc(proc);
+        }
+        dp.exec();
+    }
+    return (now() - start) * 1e6 / (pipelines * stages);
+}
+
+int main(int argc, char **argv)
+{
+    int pipelines = argc > 1 ? atoi(argv[1]) : 20;
+    int stages = argc > 2 ? atoi(argv[2]) : 10;
+    std::vector<size_t> sizes;
+    for(int i = 3; i < argc; ++i)
+        sizes.push_back(atol(argv[i]));
+    if(sizes.empty())
+    {
+        sizes.push_back(0);
+        sizes.push_back(100);
+        sizes.push_back(1024);
+    }
+
+    printf("%8s %12s %12s\n", "rss(MB)", "fork(us)", "spawn(us)");
+    std::vector<char *> ballast;
+    size_t have = 0;
+    try
+    {
+        for(std::vector<size_t>::const_iterator i = sizes.begin(), end = sizes.end(); i != end; ++i)
+        {
+            // grow the resident set to the requested size, touching every page
+            if(*i > have)
+            {
+                size_t len = (*i - have) << 20;
+                char *p = static_cast<char *>(malloc(len));
+                if(!p)
+                    throw failure("unable to allocate %zu MB", *i - have);
+                memset(p, 1, len);
+                ballast.push_back(p);
+                have = *i;
+            }
+
+            double forkUS = run(pipelines, stages, true);
+            double spawnUS = run(pipelines, stages, false);
+            printf("%8zu %12.1f %12.1f\n", have, forkUS, spawnUS);
+        }
+    }
+    catch(failure &f)
+    {
+        fprintf(stderr, "bench_spawn: %s\n", f.what());
+        return 1;
+    }
+    return 0;
+}
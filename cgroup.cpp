@@ -0,0 +1,188 @@
+#include "cgroup.hpp"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+#define CHECK(cond, fmt...) \
+    do { \
+        if(!(cond)) \
+            throw failure(fmt); \
+    } while(0)
+
+// how long ~Cgroup waits for killed processes to go before giving up on
+// removing the cgroup
+static const int CGROUP_EMPTY_TIMEOUT_MS = 5000;
+
+Cgroup::Cgroup(const std::string &path, const cgroup_spec &spec)
+    : m_path(path)
+{
+    CHECK(mkdir(m_path.c_str(), 0755) == 0, "cgroup: mkdir %s failed: %m", m_path.c_str());
+    try
+    {
+        m_fd.reset(open(m_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        CHECK(m_fd.isOk(), "cgroup: open %s failed: %m", m_path.c_str());
+        if(!spec.m_cpuMax.empty())
+            write("cpu.max", spec.m_cpuMax);
+        if(!spec.m_memoryMax.empty())
+            write("memory.max", spec.m_memoryMax);
+        if(spec.m_ioWeight > 0)
+        {
+            char weight[16];
+            snprintf(weight, sizeof(weight), "%d", spec.m_ioWeight);
+            write("io.weight", weight);
+        }
+    }
+    catch(...)
+    {
+        rmdir(m_path.c_str());
+        throw;
+    }
+}
+
+Cgroup::~Cgroup()
+{
+    try
+    {
+        kill();
+        // the cgroup can only be removed once everything in it has exited.
+        // After a change, cgroup.events polls POLLPRI until it's read again.
+        FD events(openat(m_fd.get(), "cgroup.events", O_RDONLY | O_CLOEXEC));
+        struct pollfd pfd = { events.isOk() ? events.get() : -1, POLLPRI, 0 };
+        for(int waited = 0; events.isOk() && populated(events.get()) && waited < CGROUP_EMPTY_TIMEOUT_MS; waited += 100)
+            ::poll(&pfd, 1, 100);
+    }
+    catch(failure &)
+    {
+    }
+    m_fd.reset();
+    rmdir(m_path.c_str());
+}
+
+void Cgroup::kill()
+{
+    FD cgroupKill(openat(m_fd.get(), "cgroup.kill", O_WRONLY | O_CLOEXEC));
+    if(cgroupKill.isOk())
+    {
+        CHECK(::write(cgroupKill.get(), "1", 1) == 1, "cgroup: kill %s failed: %m", m_path.c_str());
+        return;
+    }
+
+    // without cgroup.kill, keep killing what's in cgroup.procs, ours and
+    // every child cgroup's, until nothing new turns up. The procs may have
+    // made cgroups of their own below ours, which aren't Cgroups.
+    for(int round = 0; round < 100 && killProcsBelow(m_path); ++round)
+        ;
+}
+
+bool Cgroup::killProcsBelow(const std::string &path)
+{
+    std::string file = path + "/cgroup.procs";
+    FILE *f = fopen(file.c_str(), "re");
+    if(!f && errno == ENOENT) // a child cgroup which has just been removed
+        return false;
+    CHECK(f, "cgroup: open %s failed: %m", file.c_str());
+    bool found = false;
+    long pid;
+    while(fscanf(f, "%ld", &pid) == 1)
+    {
+        ::kill(pid, SIGKILL);
+        found = true;
+    }
+    fclose(f);
+
+    std::vector<std::string> children;
+    DIR *dir = opendir(path.c_str());
+    if(!dir && errno == ENOENT)
+        return found;
+    CHECK(dir, "cgroup: opendir %s failed: %m", path.c_str());
+    while(struct dirent *ent = readdir(dir))
+    {
+        if(ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+            children.push_back(path + "/" + ent->d_name);
+    }
+    closedir(dir);
+    for(std::vector<std::string>::const_iterator i = children.begin(), end = children.end(); i != end; ++i)
+        found = killProcsBelow(*i) || found;
+    return found;
+}
+
+bool Cgroup::populated(int events)
+{
+    char buf[256];
+    ssize_t len = pread(events, buf, sizeof(buf) - 1, 0);
+    if(len <= 0)
+        return false;
+    buf[len] = '\0';
+    return strstr(buf, "populated 1") != NULL;
+}
+
+void Cgroup::write(const char *file, const std::string &value)
+{
+    FD fd(openat(m_fd.get(), file, O_WRONLY | O_CLOEXEC));
+    CHECK(fd.isOk(), "cgroup: open %s/%s failed: %m", m_path.c_str(), file);
+    CHECK(::write(fd.get(), value.c_str(), value.length()) == ssize_t(value.length()),
+        "cgroup: writing %s to %s/%s failed: %m", value.c_str(), m_path.c_str(), file);
+}
+
+void Cgroup::enableControllers(const std::string &path, const cgroup_spec &spec)
+{
+    std::vector<const char *> controllers;
+    if(!spec.m_cpuMax.empty())
+        controllers.push_back("cpu");
+    if(!spec.m_memoryMax.empty())
+        controllers.push_back("memory");
+    if(spec.m_ioWeight > 0)
+        controllers.push_back("io");
+    if(controllers.empty())
+        return;
+
+    std::string file = path + "/cgroup.subtree_control";
+    FD fd(open(file.c_str(), O_WRONLY | O_CLOEXEC));
+    CHECK(fd.isOk(), "cgroup: open %s failed: %m", file.c_str());
+    for(std::vector<const char *>::const_iterator i = controllers.begin(), end = controllers.end(); i != end; ++i)
+    {
+        std::string enable = std::string("+") + *i;
+        CHECK(::write(fd.get(), enable.c_str(), enable.length()) == ssize_t(enable.length()),
+            "cgroup: enabling the %s controller in %s failed: %m", *i, path.c_str());
+    }
+}
+
+std::string Cgroup::ownCgroup()
+{
+    // the cgroup2 mount: "id parent major:minor root mountpoint opts... - cgroup2 ..."
+    std::string mount;
+    char line[4096];
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    CHECK(f, "cgroup: open /proc/self/mountinfo failed: %m");
+    while(mount.empty() && fgets(line, sizeof(line), f))
+    {
+        char mountpoint[4096];
+        if(strstr(line, " - cgroup2 ") && sscanf(line, "%*s %*s %*s %*s %4095s", mountpoint) == 1)
+            mount = mountpoint;
+    }
+    fclose(f);
+    CHECK(!mount.empty(), "cgroup: no cgroup2 filesystem is mounted");
+
+    // and our place in it: "0::/path"
+    std::string path;
+    f = fopen("/proc/self/cgroup", "re");
+    CHECK(f, "cgroup: open /proc/self/cgroup failed: %m");
+    while(path.empty() && fgets(line, sizeof(line), f))
+    {
+        if(strncmp(line, "0::", 3) == 0)
+            path.assign(line + 3, strcspn(line + 3, "\n"));
+    }
+    fclose(f);
+    CHECK(!path.empty(), "cgroup: /proc/self/cgroup has no cgroup2 entry");
+    return path == "/" ? mount : mount + path;
+}
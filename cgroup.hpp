@@ -0,0 +1,53 @@
+#ifndef WITH_CGROUP_H
+#define WITH_CGROUP_H
+
+#include <string>
+
+#include "pipe.hpp"
+
+/// A cgroup v2 directory made for a daemon_pipe run, or for one of its
+/// procs. Children are started straight into it (see Proc::m_cgroupFD), so
+/// everything they fork stays in it too, and can be killed with one write
+/// to cgroup.kill however big the process tree has grown.
+///
+/// Limits need their controllers enabled in the parent's
+/// cgroup.subtree_control, which cgroup v2 only allows in a cgroup without
+/// processes of its own: so a pipeline with limits needs a parent which has
+/// been delegated to us and which we aren't in, and a pipeline with any
+/// per-proc cgroups puts each of its procs in a cgroup of its own.
+class Cgroup : public boost::noncopyable
+{
+public:
+    /// makes the cgroup path and applies spec's limits to it; the parent's
+    /// controllers must already be enabled
+    Cgroup(const std::string &path, const cgroup_spec &spec);
+    /// kills whatever is left in the cgroup, waits for it to go and removes it
+    ~Cgroup();
+
+    /// SIGKILLs every process in the cgroup, and its descendants' (linux
+    /// 5.14; before that, the processes are signalled one at a time, walking
+    /// down through the child cgroups)
+    void kill();
+
+    const std::string &path() const { return m_path; }
+    /// the cgroup's directory, for CLONE_INTO_CGROUP
+    int fd() const { return m_fd.get(); }
+
+    /// enables the controllers spec's limits need for the children of path
+    static void enableControllers(const std::string &path, const cgroup_spec &spec);
+    /// where the calling process is in the cgroup v2 hierarchy
+    static std::string ownCgroup();
+
+private:
+    void write(const char *file, const std::string &value);
+    /// events is an fd on our cgroup.events
+    static bool populated(int events);
+    /// SIGKILLs what's in path's cgroup.procs and its child cgroups'; says
+    /// whether there was anything
+    static bool killProcsBelow(const std::string &path);
+
+    std::string m_path;
+    FD m_fd;
+};
+
+#endif // WITH_CGROUP_H
@@ -1,13 +1,25 @@
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <cassert>
+#include <cerrno>
+#include <csignal>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include "exec.hpp"
 #include "exec_defs.hpp"
+#include "exec_spec.hpp"
+#include "exec_trace.hpp"
 
 failure::failure(const char *fmt, ...)
 {
@@ -18,6 +30,14 @@ failure::failure(const char *fmt, ...)
     va_end(ap);
 }
 
+void trace_phase(const char *component, const char *name, uint64_t start)
+{
+    with_trace trace;
+    trace.enable(getenv(WITH_TRACE_ENV));
+    trace.phase(component, name, start);
+    trace.flush();
+}
+
 void exec_args::do_execvp() const
 {
     execvp(exec_name(), &m_args.front());
@@ -30,6 +50,237 @@ void exec_args::do_execve(char * const environ[]) const
     throw failure("execve %s failed: %m", exec_name());
 }
 
+static bool read_reply(int sock, broker_reply &reply)
+{
+    char *p = reinterpret_cast<char *>(&reply);
+    size_t len = sizeof(reply);
+    while(len > 0)
+    {
+        ssize_t ret = read(sock, p, len);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return false;
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// Waits for the broker's job to finish, forwarding the signals we'd have
+// gotten as the job ourselves, then exits the same way it did.
+static void mirror_broker_job(int sock, pid_t pid)
+{
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTERM);
+    if(sigprocmask(SIG_BLOCK, &sigs, NULL) != 0)
+        throw failure("sigprocmask failed: %m");
+    int sigfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+    if(sigfd < 0)
+        throw failure("signalfd failed: %m");
+
+    broker_reply reply;
+    while(true)
+    {
+        struct pollfd fds[2] = { { sock, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            throw failure("poll failed: %m");
+        }
+        if(fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if(read(sigfd, &info, sizeof(info)) == sizeof(info))
+                kill(pid, info.ssi_signo);
+        }
+        if(fds[0].revents)
+        {
+            if(!read_reply(sock, reply) || reply.m_type != BROKER_EXITED)
+                throw failure("namespace broker hung up while running pid %d", int(pid));
+            break;
+        }
+    }
+
+    fflush(NULL);
+    if(WIFSIGNALED(reply.m_value))
+    {
+        int sig = WTERMSIG(reply.m_value);
+        signal(sig, SIG_DFL);
+        sigemptyset(&sigs);
+        sigaddset(&sigs, sig);
+        sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+        raise(sig);
+    }
+    _exit(WIFEXITED(reply.m_value) ? WEXITSTATUS(reply.m_value) : 1);
+}
+
+// Hands the request to a running namespace broker (exec_with_namespace
+// --broker) instead of execve'ing the setuid helper. If the broker starts the
+// job, this never returns: we wait for it and exit with its status. If no
+// broker can be reached, returns so the caller can fall back to the helper.
+//
+// A job started by the broker is not in our session, so interactive callers
+// (stdin is a terminal) always use the helper to keep job control working.
+static void try_exec_via_broker(const std::string &spec)
+{
+    if(isatty(STDIN_FILENO) || getenv("WITH_NO_BROKER"))
+        return;
+    uint64_t start = with_trace_now();
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, WITH_BROKER_SOCKET, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+        return;
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cwd < 0 || connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        if(cwd >= 0)
+            close(cwd);
+        close(sock);
+        return;
+    }
+
+    broker_request req;
+    req.m_magic = WITH_BROKER_MAGIC;
+    req.m_umask = umask(0);
+    umask(req.m_umask);
+
+    int fds[BROKER_NUM_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd };
+    char cmsgbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cmsgbuf, 0, sizeof(cmsgbuf));
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    close(cwd);
+    if(ret != sizeof(req))
+    {
+        close(sock);
+        return;
+    }
+
+    // nothing has been started yet, so a broker that goes away
+    // before answering still lets us fall back
+    const char *p = spec.data();
+    size_t len = spec.size();
+    while(len > 0)
+    {
+        ret = send(sock, p, len, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+        {
+            close(sock);
+            return;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    broker_reply reply;
+    if(!read_reply(sock, reply))
+    {
+        close(sock);
+        return;
+    }
+    if(reply.m_type == BROKER_FAILED)
+    {
+        // the job already complained on our stderr, same as the helper would
+        fflush(NULL);
+        _exit(reply.m_value);
+    }
+    if(reply.m_type != BROKER_STARTED)
+        throw failure("unexpected reply %d from namespace broker", int(reply.m_type));
+    trace_phase("with_exec_c", "broker request", start);
+    mirror_broker_job(sock, reply.m_value);
+}
+
+// execve's the helper with an empty environment, except that when tracing it
+// gets told when the execve started (see exec_trace.hpp)
+static void execve_helper(const exec_args &ns_argv)
+{
+    char execve_start[64];
+    snprintf(execve_start, sizeof(execve_start), WITH_TRACE_EXECVE_ENV "=%llu",
+        (unsigned long long)with_trace_now());
+    char *exec_environ[] = { getenv(WITH_TRACE_ENV) ? execve_start : NULL, NULL };
+    ns_argv.do_execve(exec_environ);
+}
+
+// Puts the spec blob in a sealed memfd for exec_with_namespace --spec-fd.
+// The fd is left open across exec on purpose. Returns -1 if this kernel has
+// no sealable memfds, so the caller can fall back to argv.
+static int make_spec_fd(const std::string &spec)
+{
+    int fd = memfd_create("with-spec", MFD_ALLOW_SEALING);
+    if(fd < 0)
+    {
+        if(errno == ENOSYS || errno == EINVAL)
+            return -1;
+        throw failure("memfd_create failed: %m");
+    }
+    for(size_t done = 0; done < spec.size(); )
+    {
+        ssize_t n = write(fd, spec.data() + done, spec.size() - done);
+        if(n < 0 && errno != EINTR)
+        {
+            failure f("writing spec memfd failed: %m");
+            close(fd);
+            throw f;
+        }
+        if(n > 0)
+            done += n;
+    }
+    if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+    {
+        failure f("sealing spec memfd failed: %m");
+        close(fd);
+        throw f;
+    }
+    return fd;
+}
+
+// execve's the helper with ns_argv plus --spec-fd for the spec blob. Returns
+// if this kernel has no sealable memfds, so the caller can fall back to
+// argv; if the execve fails, closes the memfd and throws.
+static void execve_helper_with_spec(exec_args &ns_argv, const std::string &spec)
+{
+    int spec_fd = make_spec_fd(spec);
+    if(spec_fd < 0)
+        return;
+    char arg[32];
+    snprintf(arg, sizeof(arg), "--spec-fd=%d", spec_fd);
+    ns_argv.push_back(arg);
+    try
+    {
+        execve_helper(ns_argv);
+    }
+    catch(...)
+    {
+        close(spec_fd);
+        throw;
+    }
+}
+
 void exec_with_namespace(
     const std::string &devname,
     // the target=src key-value pairs defining the namespace
@@ -37,10 +288,28 @@ void exec_with_namespace(
     // the command we want to run inside the namespace
     const std::vector<std::string> &cmd_argv)
 {
-    // push args and execve exec_with_namespace
-    // usage: exec_with_namespace cmd args... -- mount-name target1=src1 target2=src
+    uint64_t start = with_trace_now();
+    spec_writer spec;
+    spec.add_section(cmd_argv);
+    spec.add_section(std::vector<std::string>(1, devname));
+    spec.add_section(namespace_argv);
+    spec.add_section(environ);
+    const std::string &blob = spec.finish();
+    trace_phase("with_exec_c", "build spec", start);
+    try_exec_via_broker(blob);
+
+    // exec_with_namespace must be setuid. This means it receives
+    // a sanitized copy of the environment thanks to glibc/ld.so.
+    // However, we don't want to modify the environment; as a workaround,
+    // pass the environment along with everything else, in a memfd if we can
+    // and otherwise on the commandline. We can also empty out
+    // with_namespace_suid's environ since it doesn't need it;
     exec_args ns_argv;
     ns_argv.push_back(WITH_NAMESPACE_DIR "/exec_with_namespace");
+
+    execve_helper_with_spec(ns_argv, blob);
+
+    // usage: exec_with_namespace cmd args... -- mount-name target1=src1 target2=src
     for (std::vector<std::string>::const_iterator i = cmd_argv.begin(), end = cmd_argv.end();
         i != end; ++i)
         ns_argv.push_back(i->c_str());
@@ -58,12 +327,34 @@ void exec_with_namespace(
     for (; *env; ++env)
         ns_argv.push_back(*env);
 
-    // exec_with_namespace must be setuid. This means it receives
-    // a sanitized copy of the environment thanks to glibc/ld.so.
-    // However, we don't want to modify the environment; as a workaround,
-    // pass the environment on the commandline. We can also empty out
-    // with_namespace_suid's environ since it doesn't need it;
+    execve_helper(ns_argv);
+}
 
-    char *exec_environ[] = { NULL };
-    ns_argv.do_execve(exec_environ);
+void exec_in_namespace_of(pid_t pid, const std::vector<std::string> &cmd_argv)
+{
+    // usage: exec_with_namespace --join=pid --spec-fd=N, with the command
+    // and environment in the spec (and no devname or targets), or failing
+    // that exec_with_namespace --join=pid cmd args... -- env
+    exec_args ns_argv;
+    ns_argv.push_back(WITH_NAMESPACE_DIR "/exec_with_namespace");
+    char arg[32];
+    snprintf(arg, sizeof(arg), "--join=%d", int(pid));
+    ns_argv.push_back(arg);
+
+    spec_writer spec;
+    spec.add_section(cmd_argv);
+    spec.add_section(std::vector<std::string>());
+    spec.add_section(std::vector<std::string>());
+    spec.add_section(environ);
+    execve_helper_with_spec(ns_argv, spec.finish());
+
+    for (std::vector<std::string>::const_iterator i = cmd_argv.begin(), end = cmd_argv.end();
+        i != end; ++i)
+        ns_argv.push_back(i->c_str());
+
+    ns_argv.push_back("--");
+    for (char **env = environ; *env; ++env)
+        ns_argv.push_back(*env);
+
+    execve_helper(ns_argv);
 }
@@ -5,6 +5,9 @@
 #include <vector>
 #include <string>
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include <boost/noncopyable.hpp>
 
 class failure : public std::exception
@@ -32,6 +35,10 @@ struct exec_args : public boost::noncopyable
     std::vector<char *> m_args;
 };
 
+// Appends the phase name of component, which ran from start (a
+// with_trace_now() time) until now, to the WITH_TRACE file if there is one.
+void trace_phase(const char *component, const char *name, uint64_t start);
+
 void exec_with_namespace(
     const std::string &devname,
     // the target=src key-value pairs defining the namespace
@@ -39,4 +46,8 @@ void exec_with_namespace(
     // the command we want to run inside the namespace
     const std::vector<std::string> &cmd_argv);
 
+// Runs cmd_argv in the existing with namespace of pid, which must be one of
+// our processes. Never returns, except by throwing failure.
+void exec_in_namespace_of(pid_t pid, const std::vector<std::string> &cmd_argv);
+
 #endif // WITH_EXEC_H
@@ -6,5 +6,7 @@
 #define WITH_MOUNTPOINT "/with"
 #define WITH_RUNFILE "/var/run/with.inited"
 #define WITH_NAMESPACE_DIR "/usr/bin"
+#define WITH_BROKER_SOCKET "/var/run/with.sock"
+#define WITH_CACHE_DIR "/var/cache/with"
 
 #endif // WITH_EXEC_DEFS_H
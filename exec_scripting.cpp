@@ -1,9 +1,17 @@
 #include <cerrno>
+#include <cmath>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 extern "C"
 {
@@ -15,6 +23,9 @@ LUALIB_API int luaopen_with_exec_c(lua_State *L);
 
 #include "exec.hpp"
 #include "exec_defs.hpp"
+#include "exec_trace.hpp"
+#include "ns_index.hpp"
+#include "ns_scan.hpp"
 #include "pipe.hpp"
 
 template<typename T>
@@ -47,6 +58,13 @@ static void exec_with_namespace_internal(
     exec_with_namespace(devname, namespace_argv, cmd_argv);
 }
 
+static void exec_in_namespace_of_internal(int pid, const luabind::object &cmd_argv_obj)
+{
+    std::vector<std::string> cmd_argv;
+    copyCmdFromLua(cmd_argv, cmd_argv_obj, "exec_in_namespace_of.cmd");
+    exec_in_namespace_of(pid, cmd_argv);
+}
+
 static std::string luadirname(const std::string &path)
 {
     char *buf = strdup(path.c_str()),
@@ -65,6 +83,290 @@ static std::string luabasename(const std::string &path)
     return retStr;
 }
 
+// a target from a namespace index, split into its path components
+struct index_entry
+{
+    std::vector<std::string> m_path;
+    const char *m_source; // NULL for the metadata files
+
+    bool operator<(const index_entry &other) const { return m_path < other.m_path; }
+};
+
+// a read-only mapping of a whole file, unmapped when we're done with it
+struct index_mapping : public boost::noncopyable
+{
+    index_mapping() : m_addr(MAP_FAILED), m_len(0) {}
+    ~index_mapping() { if(m_addr != MAP_FAILED) munmap(m_addr, m_len); }
+
+    bool map(const char *path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            m_len = st.st_size;
+            m_addr = mmap(NULL, m_len, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        return m_addr != MAP_FAILED;
+    }
+
+    void *m_addr;
+    size_t m_len;
+};
+
+// builds the show_directory() style table for [begin, end), which all share
+// their first depth path components
+static luabind::object index_entries_to_table(lua_State *st,
+    std::vector<index_entry>::const_iterator begin, std::vector<index_entry>::const_iterator end, size_t depth)
+{
+    luabind::object ret = luabind::newtable(st);
+    int i = 1;
+    while(begin != end)
+    {
+        const std::string &name = begin->m_path[depth];
+        std::vector<index_entry>::const_iterator next = begin + 1;
+        while(next != end && next->m_path[depth] == name)
+            ++next;
+
+        luabind::object entry = luabind::newtable(st);
+        entry["from"] = name;
+        if(begin->m_path.size() > depth + 1)
+            entry["to"] = index_entries_to_table(st, begin, next, depth + 1);
+        else if(begin->m_source)
+            entry["to"] = std::string(begin->m_source);
+        ret[i++] = entry;
+        begin = next;
+    }
+    return ret;
+}
+
+// Returns the namespace recorded in the .index file at path (see
+// ns_index.hpp) in the same form as show_directory() in with_exec.lua, or
+// nil if there's no usable index there.
+static luabind::object read_namespace_index(lua_State *st, const std::string &path)
+{
+    index_mapping mapping;
+    ns_index_reader index;
+    if(!mapping.map(path.c_str()) || !index.parse(static_cast<const char *>(mapping.m_addr), mapping.m_len))
+        return luabind::object();
+
+    // the metadata files which are next to the index, as show_directory()
+    // would see them; the init.d namespace has no .env, for one
+    static const char *const metadata_files[] = { ".ns", ".env", ".index" };
+    std::string dir = path.substr(0, path.rfind('/') + 1);
+    std::vector<const char *> present;
+    for(size_t i = 0; i < sizeof(metadata_files) / sizeof(metadata_files[0]); ++i)
+    {
+        struct stat st;
+        if(lstat((dir + metadata_files[i]).c_str(), &st) == 0)
+            present.push_back(metadata_files[i]);
+    }
+
+    std::vector<index_entry> entries(index.num_targets() + present.size());
+    std::vector<index_entry>::iterator entry = entries.begin();
+    for(uint32_t i = 0; i < index.num_targets(); ++i, ++entry)
+    {
+        // the same components ns_builder made directories out of
+        for(const char *p = index.target(i); *p; )
+        {
+            const char *start = p;
+            while(*p && *p != '/')
+                ++p;
+            if(p - start > 1 || (p - start == 1 && *start != '.'))
+                entry->m_path.push_back(std::string(start, p));
+            if(*p)
+                ++p;
+        }
+        entry->m_source = index.source(i);
+        if(entry->m_path.empty())
+            throw failure("bad target %s in %s", index.target(i), path.c_str());
+    }
+    for(size_t i = 0; entry != entries.end(); ++i, ++entry)
+    {
+        entry->m_path.push_back(present[i]);
+        entry->m_source = NULL;
+    }
+
+    std::sort(entries.begin(), entries.end());
+    return index_entries_to_table(st, entries.begin(), entries.end(), 0);
+}
+
+// an entry of a directory under /with, as show_directory() sees it
+struct dir_entry
+{
+    std::string m_name;
+    unsigned char m_type; // DT_DIR, DT_LNK or anything else
+
+    bool operator<(const dir_entry &other) const { return m_name < other.m_name; }
+};
+
+// reads every entry of dirfd but . and .., a bufferful per getdents64
+static void read_dir_entries(int dirfd, const std::string &path, std::vector<char> &buf, std::vector<dir_entry> &entries)
+{
+    for(;;)
+    {
+        long len = syscall(SYS_getdents64, dirfd, &buf[0], buf.size());
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            throw failure("getdents %s failed: %m", path.c_str());
+        }
+        if(len == 0)
+            return;
+
+        for(long off = 0; off < len; )
+        {
+            const struct dirent64 *d = reinterpret_cast<const struct dirent64 *>(&buf[off]);
+            off += d->d_reclen;
+            if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            dir_entry entry;
+            entry.m_name = d->d_name;
+            entry.m_type = d->d_type;
+            // not every filesystem fills in d_type
+            struct stat st;
+            if(entry.m_type == DT_UNKNOWN && fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                entry.m_type = IFTODT(st.st_mode);
+            entries.push_back(entry);
+        }
+    }
+}
+
+// show_directory() for the directory dirfd, which is at path
+static luabind::object show_directory_at(lua_State *st, int dirfd, const std::string &path, std::vector<char> &buf)
+{
+    std::vector<dir_entry> entries;
+    read_dir_entries(dirfd, path, buf, entries);
+    std::sort(entries.begin(), entries.end());
+
+    luabind::object ret = luabind::newtable(st);
+    int i = 1;
+    for(std::vector<dir_entry>::const_iterator it = entries.begin(), end = entries.end(); it != end; ++it)
+    {
+        luabind::object entry = luabind::newtable(st);
+        entry["from"] = it->m_name;
+        if(it->m_type == DT_DIR)
+        {
+            std::string subpath = path + "/" + it->m_name;
+            FD subdir(openat(dirfd, it->m_name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+            if(!subdir.isOk())
+                throw failure("opendir %s failed: %m", subpath.c_str());
+            entry["to"] = show_directory_at(st, subdir.get(), subpath, buf);
+        }
+        else if(it->m_type == DT_LNK)
+        {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd, it->m_name.c_str(), target, sizeof(target));
+            if(len >= 0)
+                entry["to"] = std::string(target, len);
+        }
+        ret[i++] = entry;
+    }
+    return ret;
+}
+
+// Returns the symlinks under directory as a table of { from = name, to = x }
+// sorted by name, where x is the link's target, a table like this one for a
+// subdirectory, or nil for anything else. Everything below directory is
+// opened relative to its parent's fd, so no path is resolved twice.
+static luabind::object show_directory(lua_State *st, const std::string &directory)
+{
+    FD dir(open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(!dir.isOk())
+        throw failure("opendir %s failed: %m", directory.c_str());
+    std::vector<char> buf(32768);
+    return show_directory_at(st, dir.get(), directory, buf);
+}
+
+// the scan_with_namespaces() results as a list of
+// { ns = inode, devname = name, used = bytes, pids = { pid, ... } }
+static luabind::object list_namespaces(lua_State *st, int threads)
+{
+    std::vector<with_namespace_info> namespaces;
+    scan_with_namespaces(threads, namespaces);
+
+    luabind::object ret = luabind::newtable(st);
+    for(size_t i = 0; i < namespaces.size(); ++i)
+    {
+        const with_namespace_info &info = namespaces[i];
+        luabind::object entry = luabind::newtable(st), pids = luabind::newtable(st);
+        for(size_t j = 0; j < info.m_pids.size(); ++j)
+            pids[j + 1] = int(info.m_pids[j]);
+        entry["ns"] = double(info.m_ino);
+        entry["devname"] = info.m_devname;
+        entry["used"] = double(info.m_used);
+        entry["cached"] = info.m_cached;
+        entry["pids"] = pids;
+        ret[i + 1] = entry;
+    }
+    return ret;
+}
+
+// "dev ino mtime size" of path, following symlinks, or nil if it can't be
+// stat'ed: what changes when the file's contents do
+static luabind::object file_identity(lua_State *st, const std::string &path)
+{
+    struct stat sb;
+    if(stat(path.c_str(), &sb) != 0)
+        return luabind::object();
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%llu %llu %lld.%09ld %lld", (unsigned long long)sb.st_dev,
+        (unsigned long long)sb.st_ino, (long long)sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec, (long long)sb.st_size);
+    return luabind::object(st, std::string(buf));
+}
+
+// trace_now() and trace(name, start) let the lua side record its own
+// phases; lua numbers are doubles, which hold microseconds since boot exactly
+static double lua_trace_now()
+{
+    return double(with_trace_now());
+}
+
+static void lua_trace(const std::string &name, double start)
+{
+    trace_phase("with", name.c_str(), uint64_t(start));
+}
+
+// the cgroup settings of dp:cgroup{} or add_proc{cgroup = {}}; only a
+// pipeline's can say where its cgroup goes
+static cgroup_spec_ptr cgroup_from_lua(luabind::object const &tbl, const char *where, bool pipeline)
+{
+    cgroup_spec_ptr cgroup(new cgroup_spec);
+    for(luabind::iterator iter(tbl), end; iter != end; ++iter)
+    {
+        int keytype = luabind::type(iter.key());
+        if(keytype != LUA_TSTRING)
+            throw failure("bad key in %s (string expected, got %s)", where, lua_typename(tbl.interpreter(), keytype));
+        const char *key = luabind::object_cast<const char *>(iter.key());
+        if(pipeline && strcmp(key, "parent") == 0)
+            cgroup->m_parent = luabind::object_cast<std::string>(*iter);
+        else if(strcmp(key, "cpu_max") == 0)
+            cgroup->m_cpuMax = luabind::object_cast<std::string>(*iter);
+        else if(strcmp(key, "memory_max") == 0)
+            cgroup->m_memoryMax = luabind::object_cast<std::string>(*iter);
+        else if(strcmp(key, "io_weight") == 0)
+        {
+            // 0 is how cgroup_spec says "leave it alone", so it can't be given
+            cgroup->m_ioWeight = luabind::object_cast<int>(*iter);
+            if(cgroup->m_ioWeight < 1 || cgroup->m_ioWeight > 10000)
+                throw failure("%s: io_weight must be between 1 and 10000", where);
+        }
+        else
+            throw failure("unknown key %s in %s", key, where);
+    }
+    return cgroup;
+}
+
+static void daemon_pipe_cgroup(daemon_pipe_ptr const &pipe, luabind::object const &tbl)
+{
+    pipe->m_cgroup = cgroup_from_lua(tbl, "daemon_pipe:cgroup", true);
+}
+
 static daemon_proc_spec_ptr daemon_pipe_add_proc(daemon_pipe_ptr const &pipe, luabind::object const &tbl)
 {
     daemon_proc_spec_ptr proc(new daemon_proc_spec);
@@ -89,17 +391,146 @@ static daemon_proc_spec_ptr daemon_pipe_add_proc(daemon_pipe_ptr const &pipe, lu
             copyCmdFromLua(proc->m_cmdArgv, *iter, "daemon_pipe:add_proc.cmd");
             cmdFound = true;
         }
+        else if(strcmp(key, "restart") == 0)
+        {
+            std::string restart = luabind::object_cast<std::string>(*iter);
+            if(restart == "no")              proc->m_restart = daemon_proc_spec::RESTART_NO;
+            else if(restart == "on-failure") proc->m_restart = daemon_proc_spec::RESTART_ON_FAILURE;
+            else if(restart == "always")     proc->m_restart = daemon_proc_spec::RESTART_ALWAYS;
+            else throw failure("daemon_pipe:add_proc: unknown restart policy %s", restart.c_str());
+        }
+        else if(strcmp(key, "backoff") == 0)
+        {
+            // in seconds, like poll()'s timeout
+            for(luabind::iterator b(*iter), bend; b != bend; ++b)
+            {
+                const char *bkey = luabind::type(b.key()) == LUA_TSTRING ? luabind::object_cast<const char *>(b.key()) : "";
+                if(strcmp(bkey, "min") == 0)
+                    proc->m_backoffMinMS = int(luabind::object_cast<double>(*b) * 1000);
+                else if(strcmp(bkey, "max") == 0)
+                    proc->m_backoffMaxMS = int(luabind::object_cast<double>(*b) * 1000);
+                else
+                    throw failure("daemon_pipe:add_proc: backoff takes min and max");
+            }
+        }
+        else if(strcmp(key, "max_restarts_per_min") == 0)
+            proc->m_maxRestartsPerMin = luabind::object_cast<int>(*iter);
+        else if(strcmp(key, "cgroup") == 0)
+            proc->m_cgroup = cgroup_from_lua(*iter, "daemon_pipe:add_proc.cgroup", false);
         else
             throw failure("unknown key %s in daemon_pipe:add_proc", key);
     }
 
     if(!cmdFound)
         throw failure("daemon_pipe:add_proc: cmd is required");
+    if(proc->m_backoffMinMS < 0 || proc->m_backoffMaxMS < proc->m_backoffMinMS)
+        throw failure("daemon_pipe:add_proc: backoff needs 0 <= min <= max");
+    if(proc->m_maxRestartsPerMin < 0)
+        throw failure("daemon_pipe:add_proc: max_restarts_per_min must not be negative");
 
     pipe->add_proc(proc);
     return proc;
 }
 
+static file_spec_ptr daemon_pipe_pipe(daemon_pipe_ptr const &pipe)
+{
+    return pipe->add_pipe();
+}
+
+static file_spec_ptr daemon_pipe_pipe_size(daemon_pipe_ptr const &pipe, int size)
+{
+    return pipe->add_pipe(size);
+}
+
+static file_spec_ptr daemon_pipe_pipe_adaptive(daemon_pipe_ptr const &pipe, int size, bool adaptive)
+{
+    return pipe->add_pipe(size, adaptive);
+}
+
+static file_spec_ptr daemon_pipe_tee_policy(daemon_pipe_ptr const &pipe, int readers, const std::string &policy)
+{
+    if(policy == "block")
+        return pipe->add_tee(readers, file_spec::TEE_BLOCK);
+    if(policy == "drop")
+        return pipe->add_tee(readers, file_spec::TEE_DROP);
+    if(policy == "spill")
+        return pipe->add_tee(readers, file_spec::TEE_SPILL);
+    throw failure("daemon_pipe:tee: unknown policy %s (expected block, drop or spill)", policy.c_str());
+}
+
+static file_spec_ptr daemon_pipe_tee(daemon_pipe_ptr const &pipe, int readers)
+{
+    return pipe->add_tee(readers);
+}
+
+static file_spec_ptr daemon_pipe_log_sink(daemon_pipe_ptr const &pipe, luabind::object const &tbl)
+{
+    log_sink_spec_ptr logSink(new log_sink_spec);
+
+    for(luabind::iterator iter(tbl), end; iter != end; ++iter)
+    {
+        int keytype = luabind::type(iter.key());
+        if(keytype != LUA_TSTRING)
+            throw failure("bad key in daemon_pipe:log_sink (string expected, got %s)", lua_typename(tbl.interpreter(), keytype));
+        const char *key = luabind::object_cast<const char *>(iter.key());
+        if(strcmp(key, "path") == 0)
+            logSink->m_path = luabind::object_cast<std::string>(*iter);
+        else if(strcmp(key, "max_bytes") == 0)
+        {
+            // a lua number is a double; anything else wouldn't survive the
+            // conversion to a byte count
+            double maxBytes = luabind::object_cast<double>(*iter);
+            if(!(maxBytes >= 0 && maxBytes <= 9007199254740992.0) || maxBytes != floor(maxBytes))
+                throw failure("daemon_pipe:log_sink: max_bytes must be a whole number of bytes, not %g", maxBytes);
+            logSink->m_maxBytes = (unsigned long long)maxBytes;
+        }
+        else if(strcmp(key, "keep") == 0)
+            logSink->m_keep = luabind::object_cast<int>(*iter);
+        else if(strcmp(key, "flush_ms") == 0)
+            logSink->m_flushMS = luabind::object_cast<int>(*iter);
+        else if(strcmp(key, "rotate_secs") == 0)
+            logSink->m_rotateSecs = luabind::object_cast<int>(*iter);
+        else
+            throw failure("unknown key %s in daemon_pipe:log_sink", key);
+    }
+
+    return pipe->add_log_sink(logSink);
+}
+
+static luabind::object file_spec_pipe_size(lua_State *st, file_spec_ptr const &spec)
+{
+    if(spec->m_actualPipeSize <= 0) return luabind::object();
+    else                            return luabind::object(st, spec->m_actualPipeSize);
+}
+
+static luabind::object file_spec_bytes_written(lua_State *st, file_spec_ptr const &spec)
+{
+    if(!spec->m_logSink) return luabind::object();
+    else                 return luabind::object(st, double(spec->m_logSink->m_bytesWritten));
+}
+
+static luabind::object file_spec_rotations(lua_State *st, file_spec_ptr const &spec)
+{
+    if(!spec->m_logSink) return luabind::object();
+    else                 return luabind::object(st, spec->m_logSink->m_rotations);
+}
+
+static bool daemon_pipe_poll(daemon_pipe_ptr const &pipe)
+{
+    return pipe->poll(0);
+}
+
+static bool daemon_pipe_poll_timeout(daemon_pipe_ptr const &pipe, double timeout)
+{
+    return pipe->poll(timeout < 0 ? -1 : int(timeout * 1000));
+}
+
+static luabind::object daemon_pipe_fd(lua_State *st, daemon_pipe_ptr const &pipe)
+{
+    if(!pipe->running()) return luabind::object();
+    else                 return luabind::object(st, pipe->fd());
+}
+
 static void try_error_write(const luabind::object &cmd_argv, const std::string &input)
 {
     daemon_pipe args;
@@ -145,6 +576,71 @@ static luabind::object daemon_proc_termsig(lua_State *st, daemon_proc_spec_ptr c
         return luabind::object(st, int(WTERMSIG(proc->getStatus())));
 }
 
+enum proc_usage { USAGE_START_TIME, USAGE_END_TIME, USAGE_WALL_TIME, USAGE_UTIME, USAGE_STIME,
+                  USAGE_MAXRSS, USAGE_NVCSW, USAGE_NIVCSW };
+
+static double timeval_secs(const struct timeval &tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// the resource usage properties of a proc. Times are in seconds, maxrss in
+// KB; all but start_time are nil until the proc has finished.
+template<proc_usage U>
+static luabind::object daemon_proc_usage(lua_State *st, daemon_proc_spec_ptr const &proc)
+{
+    if(!(U == USAGE_START_TIME ? proc->started() : proc->finished()))
+        return luabind::object();
+    const struct rusage &ru = proc->m_rusage;
+    switch(U)
+    {
+        case USAGE_START_TIME: return luabind::object(st, proc->m_startTime);
+        case USAGE_END_TIME:   return luabind::object(st, proc->m_endTime);
+        case USAGE_WALL_TIME:  return luabind::object(st, proc->m_wallTime);
+        case USAGE_UTIME:      return luabind::object(st, timeval_secs(ru.ru_utime));
+        case USAGE_STIME:      return luabind::object(st, timeval_secs(ru.ru_stime));
+        case USAGE_MAXRSS:     return luabind::object(st, double(ru.ru_maxrss));
+        case USAGE_NVCSW:      return luabind::object(st, double(ru.ru_nvcsw));
+        case USAGE_NIVCSW:     return luabind::object(st, double(ru.ru_nivcsw));
+    }
+    return luabind::object();
+}
+
+// dp:run(): runs the pipeline, and returns the result of each proc in the
+// order they were added
+static luabind::object daemon_pipe_run(lua_State *st, daemon_pipe_ptr const &pipe)
+{
+    pipe->exec();
+
+    luabind::object ret = luabind::newtable(st);
+    const std::vector<daemon_proc_spec_ptr> &procs = pipe->procs();
+    for(size_t i = 0; i < procs.size(); ++i)
+    {
+        const daemon_proc_spec_ptr &proc = procs[i];
+        luabind::object result = luabind::newtable(st);
+        result["pid"] = daemon_proc_get_pid(st, proc);
+        result["exited"] = daemon_proc_exited(st, proc);
+        result["exitstatus"] = daemon_proc_exitstatus(st, proc);
+        result["signalled"] = daemon_proc_signaled(st, proc);
+        result["termsig"] = daemon_proc_termsig(st, proc);
+        result["start_time"] = daemon_proc_usage<USAGE_START_TIME>(st, proc);
+        result["end_time"] = daemon_proc_usage<USAGE_END_TIME>(st, proc);
+        result["wall_time"] = daemon_proc_usage<USAGE_WALL_TIME>(st, proc);
+        result["utime"] = daemon_proc_usage<USAGE_UTIME>(st, proc);
+        result["stime"] = daemon_proc_usage<USAGE_STIME>(st, proc);
+        result["maxrss"] = daemon_proc_usage<USAGE_MAXRSS>(st, proc);
+        result["nvcsw"] = daemon_proc_usage<USAGE_NVCSW>(st, proc);
+        result["nivcsw"] = daemon_proc_usage<USAGE_NIVCSW>(st, proc);
+        result["restarts"] = proc->m_restarts;
+        // the sizes the proc's pipes ended up with, adaptive ones included
+        if(proc->m_stdin)  result["stdin_pipe_size"] = file_spec_pipe_size(st, proc->m_stdin);
+        if(proc->m_stdout) result["stdout_pipe_size"] = file_spec_pipe_size(st, proc->m_stdout);
+        if(proc->m_stderr) result["stderr_pipe_size"] = file_spec_pipe_size(st, proc->m_stderr);
+        ret[i + 1] = result;
+    }
+    return ret;
+}
+
 void translate_failure(lua_State* L, failure const& e)
 {
     // prevents lua errormessages from having "std::exception:" tacked on front
@@ -155,35 +651,74 @@ LUALIB_API int luaopen_with_exec_c(lua_State *L)
 {
     using namespace luabind;
     const char *libname = "with_exec_c";
+    // everything up to here (starting lua, the modules required before
+    // us and loading this one) can only be timed from the process start
+    if(getenv(WITH_TRACE_ENV))
+        trace_phase("with", "lua startup", with_trace_process_start());
+    uint64_t start = with_trace_now();
     open(L);
     register_exception_handler<failure>(&translate_failure);
 
     module(L, libname)
     [
         def("exec_with_namespace_internal", exec_with_namespace_internal),
+        def("exec_in_namespace_of_internal", exec_in_namespace_of_internal),
         def("dirname", luadirname),
         def("basename", luabasename),
         def("try_error_write", try_error_write),
-        class_<file_spec, file_spec_ptr>("file_spec"),
+        def("read_namespace_index", read_namespace_index),
+        def("show_directory", show_directory),
+        def("list_namespaces", list_namespaces),
+        def("file_identity", file_identity),
+        def("trace_now", lua_trace_now),
+        def("trace", lua_trace),
+        class_<file_spec, file_spec_ptr>("file_spec")
+            .property("pipe_size", &file_spec_pipe_size)
+            .property("bytes_written", &file_spec_bytes_written)
+            .property("rotations", &file_spec_rotations),
         class_<daemon_proc_spec, daemon_proc_spec_ptr>("daemon_proc_spec")
             .property("finished", &daemon_proc_spec::finished)
             .property("pid", &daemon_proc_get_pid)
             .property("WIFEXITED", &daemon_proc_exited)
             .property("WIFSIGNALED", &daemon_proc_signaled)
             .property("WEXITSTATUS", &daemon_proc_exitstatus)
-            .property("WTERMSIG", &daemon_proc_termsig),
+            .property("WTERMSIG", &daemon_proc_termsig)
+            .def_readonly("restarts", &daemon_proc_spec::m_restarts)
+            .def_readonly("crash_looping", &daemon_proc_spec::m_crashLooping)
+            .property("start_time", &daemon_proc_usage<USAGE_START_TIME>)
+            .property("end_time", &daemon_proc_usage<USAGE_END_TIME>)
+            .property("wall_time", &daemon_proc_usage<USAGE_WALL_TIME>)
+            .property("utime", &daemon_proc_usage<USAGE_UTIME>)
+            .property("stime", &daemon_proc_usage<USAGE_STIME>)
+            .property("maxrss", &daemon_proc_usage<USAGE_MAXRSS>)
+            .property("nvcsw", &daemon_proc_usage<USAGE_NVCSW>)
+            .property("nivcsw", &daemon_proc_usage<USAGE_NIVCSW>),
         class_<daemon_pipe, daemon_pipe_ptr>("daemon_pipe")
             .def(constructor<>())
-            .def("pipe", &daemon_pipe::add_pipe)
+            .def("pipe", &daemon_pipe_pipe)
+            .def("pipe", &daemon_pipe_pipe_size)
+            .def("pipe", &daemon_pipe_pipe_adaptive)
+            .def("tee", &daemon_pipe_tee)
+            .def("tee", &daemon_pipe_tee_policy)
+            .def("log_sink", &daemon_pipe_log_sink)
             .def("file", (file_spec_ptr (daemon_pipe::*)(const std::string &))&daemon_pipe::add_file)
             .def("file", (file_spec_ptr (daemon_pipe::*)(const std::string &, bool))&daemon_pipe::add_file)
             .def_readwrite("lock_file", &daemon_pipe::m_lockFile)
+            .def_readwrite("use_fork", &daemon_pipe::m_useFork)
             .property("devnull", &daemon_pipe::get_devnull)
             .property("caller_stdin", &daemon_pipe::get_caller_stdin)
             .property("caller_stdout", &daemon_pipe::get_caller_stdout)
             .property("caller_stderr", &daemon_pipe::get_caller_stderr)
             .def("add_proc", &daemon_pipe_add_proc)
-            .def("run", &daemon_pipe::exec)
+            .def("run", &daemon_pipe_run)
+            .def("start", &daemon_pipe::start)
+            .def("poll", &daemon_pipe_poll)
+            .def("poll", &daemon_pipe_poll_timeout)
+            .def("wait", &daemon_pipe::wait)
+            .def("kill", &daemon_pipe::kill_all)
+            .def("cgroup", &daemon_pipe_cgroup)
+            .property("fd", &daemon_pipe_fd)
+            .property("running", &daemon_pipe::running)
     ];
 
     luabind::object lib(luabind::globals(L)[libname]);
@@ -194,5 +729,6 @@ LUALIB_API int luaopen_with_exec_c(lua_State *L)
     lib["EEXIST"] = EEXIST;
     lib["SIGTERM"] = SIGTERM;
 
+    trace_phase("with", "register with_exec_c", start);
     return 0;
 }
@@ -0,0 +1,164 @@
+#ifndef WITH_EXEC_SPEC_H
+#define WITH_EXEC_SPEC_H
+
+// A namespace request (command, devname, targets and environment) packed
+// into one flat blob, so it can be handed to the helper without going
+// through argv.
+//
+// Layout, all integers in host byte order:
+//   u32 magic, u32 total length (including this header)
+//   then for each section, in the order of spec_section:
+//     u32 count, then count * (u32 length, bytes, '\0')
+//
+// The trailing '\0' lets the reader hand out char* pointing straight into
+// the blob instead of copying every string.
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define WITH_SPEC_MAGIC 0x57495331 // "WIS1"
+#define WITH_BROKER_MAGIC 0x57494231 // "WIB1"
+#define WITH_BROKER_STATS_MAGIC 0x57425331 // "WBS1"
+
+enum spec_section
+{
+    SPEC_CMD,
+    SPEC_DEVNAME,
+    SPEC_TARGETS,
+    SPEC_ENV,
+    SPEC_NUM_SECTIONS
+};
+
+struct spec_writer
+{
+    spec_writer() : m_buf(2 * sizeof(uint32_t), '\0')
+    {
+        put_u32(0, WITH_SPEC_MAGIC);
+    }
+
+    void add_section(const std::vector<std::string> &strs)
+    {
+        append_u32(strs.size());
+        for (std::vector<std::string>::const_iterator i = strs.begin(), end = strs.end(); i != end; ++i)
+            add_string(i->c_str(), i->size());
+    }
+
+    void add_section(char * const *strs)
+    {
+        size_t count = 0;
+        while (strs[count])
+            ++count;
+        append_u32(count);
+        for (size_t i = 0; i < count; ++i)
+            add_string(strs[i], strlen(strs[i]));
+    }
+
+    // returns the finished blob
+    const std::string &finish()
+    {
+        put_u32(sizeof(uint32_t), m_buf.size());
+        return m_buf;
+    }
+
+private:
+    void add_string(const char *s, size_t len)
+    {
+        append_u32(len);
+        m_buf.append(s, len);
+        m_buf.push_back('\0');
+    }
+
+    void append_u32(uint32_t v) { m_buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+    void put_u32(size_t off, uint32_t v) { memcpy(&m_buf[off], &v, sizeof(v)); }
+
+    std::string m_buf;
+};
+
+/// Parses a blob built by spec_writer in place. The sections point into the
+/// caller's buffer, which must stay alive (and writable, since putenv and
+/// execvp want char*) for as long as they're used.
+struct spec_reader
+{
+    // returns false if the blob is malformed
+    bool parse(char *buf, size_t len)
+    {
+        uint32_t magic, total;
+        if (len < 2 * sizeof(uint32_t))
+            return false;
+        memcpy(&magic, buf, sizeof(magic));
+        memcpy(&total, buf + sizeof(uint32_t), sizeof(total));
+        if (magic != WITH_SPEC_MAGIC || total != len)
+            return false;
+
+        char *p = buf + 2 * sizeof(uint32_t), *end = buf + len;
+        for (int s = 0; s < SPEC_NUM_SECTIONS; ++s)
+        {
+            uint32_t count;
+            if (!get_u32(p, end, count) || count > size_t(end - p) / (sizeof(uint32_t) + 1))
+                return false;
+            std::vector<char *> &section = m_sections[s];
+            section.clear();
+            section.reserve(count);
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t slen;
+                if (!get_u32(p, end, slen) || slen >= size_t(end - p) || p[slen] != '\0')
+                    return false;
+                section.push_back(p);
+                p += slen + 1;
+            }
+        }
+        return p == end;
+    }
+
+    std::vector<char *> &section(spec_section s) { return m_sections[s]; }
+
+private:
+    static bool get_u32(char *&p, char *end, uint32_t &v)
+    {
+        if (size_t(end - p) < sizeof(v))
+            return false;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return true;
+    }
+
+    std::vector<char *> m_sections[SPEC_NUM_SECTIONS];
+};
+
+// The namespace broker protocol (exec_with_namespace --broker), over a
+// SOCK_STREAM unix socket:
+//   client -> broker: broker_request, carrying the caller's stdin, stdout,
+//                     stderr and cwd as SCM_RIGHTS, then a spec blob
+//   broker -> client: BROKER_STARTED with the job's pid, or BROKER_FAILED,
+//                     then BROKER_EXITED with its wait status
+// A client which hangs up before BROKER_EXITED gets its job's session
+// killed. The broker hangs up without replying on a client whose mount
+// namespace isn't its own, which then falls back to the setuid helper.
+// A broker_request with WITH_BROKER_STATS_MAGIC and no fds instead gets
+// the state of the broker's namespace pool back as text.
+#define BROKER_NUM_FDS 4
+
+struct broker_request
+{
+    uint32_t m_magic;
+    uint32_t m_umask;
+};
+
+enum broker_reply_type
+{
+    BROKER_STARTED,
+    BROKER_FAILED,
+    BROKER_EXITED
+};
+
+struct broker_reply
+{
+    int32_t m_type;
+    int32_t m_value; // pid for BROKER_STARTED, wait status for BROKER_EXITED
+    char m_err[256]; // set for BROKER_FAILED
+};
+
+#endif // WITH_EXEC_SPEC_H
@@ -0,0 +1,152 @@
+#ifndef WITH_EXEC_TRACE_H
+#define WITH_EXEC_TRACE_H
+
+// Startup tracing for with, with_exec_c and exec_with_namespace. When
+// WITH_TRACE names a file, each of them appends the phases it goes through
+// to it as Chrome trace events, which chrome://tracing and Perfetto load.
+//
+// Times are CLOCK_BOOTTIME in microseconds, the clock the process start
+// times in /proc/<pid>/stat count in, so events from different processes
+// (and the time before a process could record anything) line up.
+//
+// The file is a JSON array whose closing ']' is left off, which the viewers
+// accept. Whoever creates the file links it into place with the '[' and
+// their events already in it; everything else goes out in single O_APPEND
+// writes, so the processes of one run (and of several runs) can share a
+// file.
+//
+// The helper is setuid, so it only keeps its events in memory and writes
+// them out once it has dropped to the caller's credentials. The helper's own
+// environment is empty apart from WITH_TRACE_EXECVE, the time with_exec_c
+// started the execve, so the execve shows up as a phase too.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+#define WITH_TRACE_ENV "WITH_TRACE"
+#define WITH_TRACE_EXECVE_ENV "WITH_TRACE_EXECVE"
+
+inline uint64_t with_trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// when the current process was started (forked, not exec'ed), or 0 if
+// /proc doesn't say. Only good to a clock tick.
+inline uint64_t with_trace_process_start()
+{
+    FILE *f = fopen("/proc/self/stat", "re");
+    if (!f)
+        return 0;
+    char buf[1024];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    // starttime is the 20th field after the ")" closing the command name
+    const char *p = strrchr(buf, ')');
+    for (int field = 0; p && field < 20; ++field)
+        p = strchr(p + 1, ' ');
+    unsigned long long ticks;
+    long hz = sysconf(_SC_CLK_TCK);
+    if (!p || hz <= 0 || sscanf(p, " %llu", &ticks) != 1)
+        return 0;
+    return ticks * 1000000 / hz;
+}
+
+struct with_trace
+{
+    with_trace() {}
+
+    // starts recording into path, the value of WITH_TRACE. Does nothing if
+    // it's NULL or empty.
+    void enable(const char *path)
+    {
+        if (path && *path)
+            m_path = path;
+    }
+
+    bool enabled() const { return !m_path.empty(); }
+
+    // records that component spent start..end in the phase name
+    void phase(const char *component, const char *name, uint64_t start, uint64_t end)
+    {
+        if (!enabled() || !start)
+            return;
+        char buf[128];
+        m_events += "{\"cat\":";
+        append_string(component);
+        m_events += ",\"name\":";
+        append_string(name);
+        snprintf(buf, sizeof(buf), ",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d},\n",
+            (unsigned long long)start, (unsigned long long)(end > start ? end - start : 0), int(getpid()),
+            int(getpid()));
+        m_events += buf;
+    }
+
+    void phase(const char *component, const char *name, uint64_t start)
+        { phase(component, name, start, with_trace_now()); }
+
+    // appends what has been recorded so far to the trace file and forgets
+    // it. The file is opened with whatever credentials we have right now.
+    void flush()
+    {
+        if (!enabled() || m_events.empty())
+            return;
+        if (!create())
+        {
+            int fd = open(m_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                ssize_t written = write(fd, m_events.data(), m_events.size());
+                (void)written;
+                close(fd);
+            }
+        }
+        m_events.clear();
+    }
+
+    std::string m_path, m_events;
+
+private:
+    // if there's no trace file yet, makes one holding the opening '[' and
+    // our events. It's written under a temporary name and linked into
+    // place, so nobody else can append before the '['. Returns false if
+    // the file is already there (or can't be made this way).
+    bool create()
+    {
+        std::string tmp = m_path + ".XXXXXX";
+        int fd = mkostemp(&tmp[0], O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        std::string contents = "[\n" + m_events;
+        bool ok = fchmod(fd, 0644) == 0 && write(fd, contents.data(), contents.size()) == ssize_t(contents.size());
+        ok = close(fd) == 0 && ok && link(tmp.c_str(), m_path.c_str()) == 0;
+        unlink(tmp.c_str());
+        return ok;
+    }
+
+    void append_string(const char *s)
+    {
+        m_events += '"';
+        for (; *s; ++s)
+        {
+            if (*s == '"' || *s == '\\')
+                m_events += '\\';
+            if ((unsigned char)*s >= ' ')
+                m_events += *s;
+        }
+        m_events += '"';
+    }
+};
+
+#endif // WITH_EXEC_TRACE_H
@@ -1,15 +1,44 @@
+#include <sys/file.h>
+#include <sys/fsuid.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/magic.h>
+#include <linux/nsfs.h>
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <cassert>
 #include <cerrno>
+#include <csignal>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
-#include <list>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
 #include <string>
 #include <vector>
 
 #include "exec_defs.hpp"
+#include "exec_spec.hpp"
+#include "exec_trace.hpp"
+#include "ns_builder.hpp"
+#include "ns_index.hpp"
 
 #define CHECK(cond, args...) \
     do { \
@@ -23,80 +52,1640 @@
 #define MNT_DETACH      0x00000002
 #endif
 
+#ifndef SO_PEERGROUPS // added in linux 4.13
+#define SO_PEERGROUPS   59
+#endif
+
+#ifndef SYS_pidfd_open // linux 5.3
+#define SYS_pidfd_open  434
+#endif
+
+// refuse spec blobs bigger than this from --spec-fd
+#define MAX_SPEC_SIZE   (64 << 20)
+
+// the broker reads requests without blocking, alongside everything else.
+// A client has this long (in microseconds) to send all of its request,
+// which can be at most this big, and each uid can have only so many
+// requests on the way at once.
+#define BROKER_REQUEST_TIMEOUT      2000000
+#define BROKER_MAX_SPEC_SIZE        (4 << 20)
+#define BROKER_MAX_PENDING_PER_UID  8
+#define BROKER_MAX_PENDING          256
+
+// a --spec-fd memfd must carry these, so it can't change under us
+#define SPEC_FD_SEALS   (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+// the broker's pool of warm namespaces: how many to keep ready per spec,
+// how long a spec may go unused before its namespaces are dropped, and how
+// many specs to keep namespaces for
+#define POOL_DEFAULT_SIZE   2
+#define POOL_DEFAULT_IDLE   300
+#define POOL_MAX_SPECS      16
+
+// a target=bind:src is bind mounted rather than linked, as is every target
+// if the environment has WITH_BIND_TARGETS. target=union:src1:src2... gets
+// a read-only overlay of the srcs.
+#define BIND_PREFIX         "bind:"
+#define UNION_PREFIX        "union:"
+#define BIND_ALL_ENV        "WITH_BIND_TARGETS"
+
+// limits on the prebuilt trees kept in WITH_CACHE_DIR
+#define CACHE_MAX_ENTRIES   32
+#define CACHE_MAX_BYTES     (256 << 20)
+
 int usage(const char *progname)
 {
     fprintf(stderr, "usage: %s cmd args... -- mount-name target1=src1 target2=src ... -- env\n"
+        "       %s --spec-fd=N\n"
+        "       %s --join=pid cmd args... -- env\n"
+        "       %s --join=pid --spec-fd=N\n"
+        "       %s --broker [socket] [--pool-size=N] [--pool-idle=seconds]\n"
+        "       %s --broker-stats [socket]\n"
         "    This is a setuid utility helper for with_exec.lua and /usr/bin/with\n"
-        "    For each target=src, makes a symlink mount-name/target1 => src.\n",
-        progname);
+        "    For each target=src, makes a symlink mount-name/target1 => src.\n"
+        "    A target=bind:src (or with WITH_BIND_TARGETS in env, any target)\n"
+        "    gets src bind mounted on it instead, if the caller can reach src.\n"
+        "    A target=union:src1:src2... gets a read-only overlay of the srcs,\n"
+        "    src1 on top.\n"
+        "    With --spec-fd, the command, mount name, targets and environment\n"
+        "    are read from a sealed memfd holding a spec blob instead (with\n"
+        "    --join, just the command and environment).\n"
+        "    With --join, runs cmd in the with namespace of pid, one of our\n"
+        "    own processes, instead of making a new one.\n"
+        "    With --broker, runs as a daemon building namespaces for clients\n"
+        "    of the unix socket (default " WITH_BROKER_SOCKET "), keeping up to\n"
+        "    pool-size (default %d) namespaces ready for each recently used set of\n"
+        "    targets. --broker-stats shows how well that's going.\n"
+        "    Installed without setuid root, builds (and joins) namespaces in a\n"
+        "    user namespace of the caller's instead.\n",
+        progname, progname, progname, progname, progname, progname, POOL_DEFAULT_SIZE);
     return 1;
 }
 
-int mkdir_p(const std::string& dir, mode_t mode)
+// the value of name in env_args (the environment we were passed), or NULL
+const char* find_env(const std::vector<char*>& env_args, const char* name)
 {
-    int ret = mkdir(dir.c_str(), mode);
-    if (ret < 0)
+    size_t len = strlen(name);
+    for (std::vector<char*>::const_iterator it = env_args.begin(), end = env_args.end(); it != end; ++it)
+        if (strncmp(*it, name, len) == 0 && (*it)[len] == '=')
+            return *it + len + 1;
+    return NULL;
+}
+
+// the phases of this run, if we were passed WITH_TRACE (see exec_trace.hpp)
+static with_trace trace;
+
+// when the next phase starts, if tracing is on
+static uint64_t trace_start()
+{
+    return trace.enabled() ? with_trace_now() : 0;
+}
+
+// records the phase name, which began at start, and returns the time it
+// ended for the next one. Costs nothing unless tracing is on.
+static uint64_t trace_phase(const char* name, uint64_t start)
+{
+    uint64_t now = trace.enabled() ? with_trace_now() : 0;
+    trace.phase("exec_with_namespace", name, start, now);
+    return now;
+}
+
+// turns tracing on if env_args has WITH_TRACE, and records the execve that
+// got us here along with the phase name, which started when main did
+static void start_trace(const std::vector<char*>& env_args, const char* name, uint64_t main_start)
+{
+    trace.enable(find_env(env_args, WITH_TRACE_ENV));
+    const char* execve_start = getenv(WITH_TRACE_EXECVE_ENV);
+    if (execve_start)
+        trace.phase("exec_with_namespace", "execve", strtoull(execve_start, NULL, 10), main_start);
+    trace_phase(name, main_start);
+}
+
+// using the namespace vector (mount-name target1=src1 target2=src2 ...),
+// create all the symlinks under root. If report is set (WITH_BUILD_STATS is
+// in the environment), says how many syscalls that took.
+int create_symlinks(const char* progname, const std::string& root, const std::vector<char*>& ns_args, bool report)
+{
+    int root_fd = open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    CHECK(root_fd >= 0, "%s: open %s failed: %m\n", progname, root.c_str());
+    ns_build_stats stats;
+    int ret = build_tree(progname, root_fd, std::vector<char*>(ns_args.begin() + 1, ns_args.end()), stats);
+    close(root_fd);
+
+    if (ret == 0 && report)
+        fprintf(stderr, "%s: built %lu links and %lu directories under %s in %lu syscalls resolving %lu "
+            "path components (per-entry paths: %lu syscalls resolving %lu)\n", progname, stats.m_entries,
+            stats.m_dirs, root.c_str(), stats.m_syscalls, stats.m_lookups, stats.m_path_syscalls, stats.m_path_lookups);
+    return ret;
+}
+
+int write_ns_metadata(const char* progname, const std::vector<char*>& ns_args)
+{
+    FILE* fd = fopen(WITH_MOUNTPOINT "/.ns", "w");
+    CHECK(fd != NULL, "%s: unable to write namespace metadata: %m\n%s\n", progname, WITH_MOUNTPOINT "/.ns");
+    for (std::vector<char*>::const_iterator it = ns_args.begin(), end = ns_args.end(); it != end; ++it)
+        fprintf(fd, "%s ", *it);
+    fclose(fd);
+    return 0;
+}
+
+// writes the binary index of ns_args and env_args (see ns_index.hpp) under
+// a temporary name, then renames it into place
+int write_index_metadata(const char* progname, const std::vector<char*>& ns_args, const std::vector<char*>& env_args)
+{
+    ns_index_writer index(ns_args.front());
+    for (std::vector<char*>::const_iterator it = ++ns_args.begin(), end = ns_args.end(); it != end; ++it)
+        index.add_target(*it);
+    for (std::vector<char*>::const_iterator it = env_args.begin(), end = env_args.end(); it != end; ++it)
+        index.add_env(*it);
+    const std::string buf = index.finish();
+
+    FILE* fd = fopen(WITH_MOUNTPOINT "/.index.tmp", "w");
+    CHECK(fd != NULL, "%s: unable to write index metadata: %m\n%s\n", progname, WITH_MOUNTPOINT "/.index.tmp");
+    bool ok = fwrite(buf.data(), 1, buf.size(), fd) == buf.size();
+    ok = fclose(fd) == 0 && ok;
+    CHECK(ok && rename(WITH_MOUNTPOINT "/.index.tmp", WITH_MOUNTPOINT "/.index") == 0,
+        "%s: unable to write index metadata: %m\n%s\n", progname, WITH_MOUNTPOINT "/.index");
+    return 0;
+}
+
+// using the namespace vector, create all the symlinks under WITH_MOUNTPOINT
+// also writes out .ns and .index metadata files
+int create_symlinks_and_metadata(const char* progname, const std::vector<char*>& ns_args, bool report)
+{
+    int ret = create_symlinks(progname, WITH_MOUNTPOINT, ns_args, report);
+    if (ret != 0)
+        return ret;
+    ret = write_ns_metadata(progname, ns_args);
+    if (ret != 0)
+        return ret;
+    return write_index_metadata(progname, ns_args, std::vector<char*>());
+}
+
+int write_env_metadata(const char* progname, const std::vector<char*>& env_args)
+{
+    FILE* fd = fopen(WITH_MOUNTPOINT "/.env", "w");
+    CHECK(fd != NULL, "%s: unable to write env metadata: %m\n%s\n", progname, WITH_MOUNTPOINT "/.env");
+    for (std::vector<char*>::const_iterator it = env_args.begin(), end = env_args.end(); it != end; ++it)
+        fprintf(fd, "%s\n", *it);
+    fclose(fd);
+    return 0;
+}
+
+// The cache of prebuilt trees lives in WITH_CACHE_DIR, a private tmpfs the
+// init script sets up. Each distinct set of targets gets its own read-only
+// tmpfs mounted at WITH_CACHE_DIR/<hash>, next to a <hash>.used file which
+// holds the canonical spec and whose mtime drives the LRU eviction.
+//
+// Trees are looked up and built in the caller's namespace, before we
+// unshare, so the new namespace gets a copy of the tree's mount. Since the
+// cache directory doesn't propagate, trees built later don't show up in
+// namespaces which are already running. The namespace mounts an overlay on
+// WITH_MOUNTPOINT with the tree as its lower layer and a fresh tmpfs as the
+// upper one, so /with stays writable just like without the cache. Since
+// every tree is a separate tmpfs, evicting one is just a lazy umount:
+// namespaces which still have a copy of it keep theirs.
+
+bool cache_usable()
+{
+    struct stat st;
+    struct statfs fs;
+    return lstat(WITH_CACHE_DIR, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == 0
+        && !(st.st_mode & (S_IWGRP | S_IWOTH))
+        && statfs(WITH_CACHE_DIR, &fs) == 0 && fs.f_type == TMPFS_MAGIC;
+}
+
+bool less_str(const char* a, const char* b)
+{
+    return strcmp(a, b) < 0;
+}
+
+// FNV-1a over the canonical spec
+std::string hash_spec(const std::string& spec)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (std::string::const_iterator i = spec.begin(), end = spec.end(); i != end; ++i)
+        h = (h ^ (unsigned char)*i) * 1099511628211ULL;
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", h);
+    return buf;
+}
+
+// the canonical spec of ns_args (mount-name target1=src1 ...): the sorted
+// targets, each terminated by a NUL. The mount name doesn't matter. Leaves
+// the sorted ns_args in sorted_args.
+std::string canonical_spec(const std::vector<char*>& ns_args, std::vector<char*>& sorted_args)
+{
+    sorted_args = ns_args;
+    std::sort(sorted_args.begin() + 1, sorted_args.end(), less_str);
+    std::string spec;
+    for (std::vector<char*>::const_iterator it = ++sorted_args.begin(), end = sorted_args.end(); it != end; ++it)
+        spec.append(*it, strlen(*it) + 1);
+    return spec;
+}
+
+// true if WITH_CACHE_DIR/<hash> is a finished tree for exactly spec. The
+// .used files are shared by every copy of the cache, so the tree has to be
+// checked for separately: a namespace made before it was built doesn't have
+// it mounted.
+bool cache_lookup(const std::string& hash, const std::string& spec)
+{
+    std::string dir = WITH_CACHE_DIR "/" + hash, used = dir + ".used";
+    struct stat cache_st, dir_st;
+    if (stat(WITH_CACHE_DIR, &cache_st) != 0 || stat(dir.c_str(), &dir_st) != 0 || dir_st.st_dev == cache_st.st_dev)
+        return false;
+    int fd = open(used.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool match = fstat(fd, &st) == 0 && size_t(st.st_size) == spec.size();
+    if (match)
+    {
+        std::vector<char> buf(spec.size() + 1);
+        match = read(fd, &buf[0], buf.size()) == ssize_t(spec.size())
+            && memcmp(&buf[0], spec.data(), spec.size()) == 0;
+    }
+    close(fd);
+    return match;
+}
+
+// builds WITH_CACHE_DIR/<hash> from the canonically ordered ns_args and
+// publishes it by writing <hash>.used. Must be called with the cache lock
+// held exclusively.
+int cache_build(const char* progname, const std::string& hash, const std::string& spec,
+    const std::vector<char*>& sorted_args, bool report)
+{
+    std::string dir = WITH_CACHE_DIR "/" + hash, used = dir + ".used";
+
+    // a leftover from a builder that died halfway, if any
+    umount2(dir.c_str(), MNT_DETACH);
+    CHECK(mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST, "%s: create %s failed: %m\n", progname, dir.c_str());
+    CHECK(mount("with-cache", dir.c_str(), "tmpfs", 0, "mode=0755") == 0,
+        "%s: mount tmpfs %s failed: %m\n", progname, dir.c_str());
+    // in case the cache directory was left shared, keep this tree's mount
+    // from propagating anywhere else
+    int ret = 0;
+    if (mount(NULL, dir.c_str(), NULL, MS_PRIVATE, NULL) != 0)
     {
-        if (errno == ENOENT)
+        fprintf(stderr, "%s: make %s private failed: %m\n", progname, dir.c_str());
+        ret = 1;
+    }
+
+    if (ret == 0)
+        ret = create_symlinks(progname, dir, sorted_args, report);
+    if (ret == 0 && mount(NULL, dir.c_str(), NULL, MS_REMOUNT | MS_RDONLY, NULL) != 0)
+    {
+        fprintf(stderr, "%s: remount %s read-only failed: %m\n", progname, dir.c_str());
+        ret = 1;
+    }
+    if (ret == 0)
+    {
+        std::string tmp = used + ".tmp";
+        FILE* fd = fopen(tmp.c_str(), "w");
+        ret = !fd || fwrite(spec.data(), 1, spec.size(), fd) != spec.size();
+        if (fd && fclose(fd) != 0)
+            ret = 1;
+        if (ret == 0 && rename(tmp.c_str(), used.c_str()) != 0)
+            ret = 1;
+        if (ret != 0)
         {
-            // If we couldn't make the whole directory because of ENOENT (a
-            // parent directory doesn't exist), then try recursively to make
-            // the immediate parent directory.
+            fprintf(stderr, "%s: write %s failed: %m\n", progname, used.c_str());
+            unlink(tmp.c_str());
+        }
+    }
+
+    if (ret != 0)
+    {
+        umount2(dir.c_str(), MNT_DETACH);
+        rmdir(dir.c_str());
+    }
+    return ret;
+}
+
+struct cache_entry
+{
+    std::string m_hash;
+    time_t m_used;
+    unsigned long long m_bytes;
 
-            size_t slash = dir.rfind('/');
-            if (slash != std::string::npos)
+    bool operator<(const cache_entry& other) const { return m_used > other.m_used; } // newest first
+};
+
+// drops the least recently used trees until the cache fits in its limits.
+// Must be called with the cache lock held exclusively.
+void cache_evict(const std::string& keep)
+{
+    DIR* dir = opendir(WITH_CACHE_DIR);
+    if (!dir)
+        return;
+
+    std::vector<cache_entry> entries;
+    while (struct dirent* d = readdir(dir))
+    {
+        size_t len = strlen(d->d_name);
+        if (len <= 5 || strcmp(d->d_name + len - 5, ".used") != 0)
+            continue;
+        cache_entry entry;
+        entry.m_hash.assign(d->d_name, len - 5);
+        std::string path = WITH_CACHE_DIR "/" + entry.m_hash;
+        struct stat st;
+        struct statfs fs;
+        if (stat((path + ".used").c_str(), &st) != 0 || statfs(path.c_str(), &fs) != 0)
+            continue;
+        entry.m_used = st.st_mtime;
+        entry.m_bytes = (unsigned long long)(fs.f_blocks - fs.f_bfree) * fs.f_bsize;
+        entries.push_back(entry);
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end());
+    unsigned long long bytes = 0;
+    size_t count = 0;
+    for (std::vector<cache_entry>::const_iterator i = entries.begin(), end = entries.end(); i != end; ++i)
+    {
+        bytes += i->m_bytes;
+        if (i->m_hash == keep || (++count <= CACHE_MAX_ENTRIES && bytes <= CACHE_MAX_BYTES))
+            continue;
+        std::string path = WITH_CACHE_DIR "/" + i->m_hash;
+        unlink((path + ".used").c_str());
+        umount2(path.c_str(), MNT_DETACH);
+        rmdir(path.c_str());
+    }
+}
+
+// Finds the cached tree for ns_args, building it first if needed, and
+// leaves its path in dir. Must be called before we unshare. On success,
+// lock holds the cache lock shared, so the tree can't get evicted before
+// the new namespace has its copy; the caller closes it once it has.
+// Returns -1 if the cache can't be used, in which case the caller should
+// create the symlinks itself.
+int find_cached_tree(const char* progname, const std::vector<char*>& ns_args, bool report, std::string& dir,
+    int& lock)
+{
+    if (!cache_usable())
+        return -1;
+
+    std::vector<char*> sorted_args;
+    std::string spec = canonical_spec(ns_args, sorted_args);
+    std::string hash = hash_spec(spec);
+    dir = WITH_CACHE_DIR "/" + hash;
+
+    lock = open(WITH_CACHE_DIR "/.lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock < 0 || flock(lock, LOCK_SH) != 0)
+    {
+        if (lock >= 0)
+            close(lock);
+        lock = -1;
+        return -1;
+    }
+    if (!cache_lookup(hash, spec))
+    {
+        if (flock(lock, LOCK_EX) != 0)
+        {
+            close(lock);
+            lock = -1;
+            return -1;
+        }
+        // someone else may have built it while we waited for the exclusive lock
+        if (!cache_lookup(hash, spec))
+        {
+            // a full cache or a failed mount shouldn't stop the job; it has
+            // said what went wrong, and the job gets symlinks of its own
+            if (cache_build(progname, hash, spec, sorted_args, report) != 0)
             {
-                std::string prefix = dir.substr(0, slash);
-                mkdir_p(prefix, mode);
-                return mkdir(dir.c_str(), mode);
+                close(lock);
+                lock = -1;
+                return -1;
             }
+            cache_evict(hash);
         }
+        flock(lock, LOCK_SH);
+    }
+    utimes((dir + ".used").c_str(), NULL);
+    return 0;
+}
+
+// Covers the freshly mounted tmpfs on WITH_MOUNTPOINT with an overlay of
+// its own directory .upper on top of the cached tree at dir. The overlay
+// gets mount_name, so it shows up the way the tmpfs would have. Returns -1
+// without touching WITH_MOUNTPOINT if the overlay can't be mounted, in which
+// case the caller should create the symlinks itself.
+int mount_cached_tree(const char* progname, const char* mount_name, const std::string& dir)
+{
+    CHECK(mkdir(WITH_MOUNTPOINT "/.upper", 01777) == 0 && chmod(WITH_MOUNTPOINT "/.upper", 01777) == 0
+        && mkdir(WITH_MOUNTPOINT "/.work", 0700) == 0,
+        "%s: create overlay directories in " WITH_MOUNTPOINT " failed: %m\n", progname);
+    std::string options = "lowerdir=" + dir + ",upperdir=" WITH_MOUNTPOINT "/.upper,workdir=" WITH_MOUNTPOINT "/.work";
+    if (mount(mount_name, WITH_MOUNTPOINT, "overlay", 0, options.c_str()) != 0)
+    {
+        rmdir(WITH_MOUNTPOINT "/.upper");
+        rmdir(WITH_MOUNTPOINT "/.work");
+        return -1;
     }
+    return 0;
+}
+
+int write_proc_file(const char* progname, const char* path, const char* contents)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    CHECK(fd >= 0, "%s: open %s failed: %m\n", progname, path);
+    ssize_t len = write(fd, contents, strlen(contents));
+    close(fd);
+    CHECK(len == ssize_t(strlen(contents)), "%s: write %s failed: %m\n", progname, path);
+    return 0;
+}
+
+// the way to a mount namespace of our own when we're not setuid root: a new
+// user namespace, in which the caller keeps their uid and gid but gets the
+// capabilities to mount things. They lose them again when we exec the
+// command, just like after dropping root. Setuid programs don't work from
+// inside, and neither do supplementary groups beyond showing up as
+// nogroup.
+int unshare_user_namespace(const char* progname)
+{
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    CHECK(unshare(CLONE_NEWUSER | CLONE_NEWNS) == 0, "%s: unshare user namespace failed: %m\n", progname);
+
+    // an unprivileged process has to give up setgroups() to map its gid
+    char map[64];
+    int ret = write_proc_file(progname, "/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "%lu %lu 1", (unsigned long)uid, (unsigned long)uid);
+    if (ret == 0)
+        ret = write_proc_file(progname, "/proc/self/uid_map", map);
+    snprintf(map, sizeof(map), "%lu %lu 1", (unsigned long)gid, (unsigned long)gid);
+    if (ret == 0)
+        ret = write_proc_file(progname, "/proc/self/gid_map", map);
     return ret;
 }
 
-// using the namespace vector, create all the symlinks under WITH_MOUNTPOINT
-// also writes out .ns metadata file
-int create_symlinks_and_metadata(const char* progname, const std::list<char*>& ns_args)
+// a target which gets its source bind mounted on it instead of a symlink,
+// so lookups under it don't have to go through a link. A union target gets
+// a read-only overlay of its sources, the first on top, or with just one
+// source a read-only bind of it.
+struct mount_target
+{
+    std::string m_target;           // below WITH_MOUNTPOINT
+    std::vector<int> m_source_fds;  // O_PATH, opened as the caller
+    bool m_dir;
+    bool m_union;
+};
+
+// the source of a target=src, if it's one of ours: prefixed by prefix
+const char* prefixed_source(const char* target_source, const char* prefix)
+{
+    const char* equal = strchr(target_source, '=');
+    return equal && strncmp(equal + 1, prefix, strlen(prefix)) == 0 ? equal + 1 + strlen(prefix) : NULL;
+}
+
+// true if any of ns_args (mount-name target1=src1 ...) is to be mounted
+bool wants_mount_targets(const std::vector<char*>& ns_args, const std::vector<char*>& env_args)
+{
+    if (find_env(env_args, BIND_ALL_ENV))
+        return true;
+    for (std::vector<char*>::const_iterator it = ns_args.begin() + 1, end = ns_args.end(); it != end; ++it)
+        if (prefixed_source(*it, BIND_PREFIX) || prefixed_source(*it, UNION_PREFIX))
+            return true;
+    return false;
+}
+
+// opens path for a bind mount with the caller's uid and gid (and groups,
+// which are already theirs) doing the permission checks, so nothing gets
+// mounted that the caller couldn't have reached through a symlink
+int open_as_caller(const char* path, uid_t uid, gid_t gid, int flags = 0)
 {
-    // create all the symlinks under WITH_MOUNTPOINT
-    for (std::list<char*>::const_iterator it = ++ns_args.begin(), end = ns_args.end(); it != end; ++it)
+    setfsgid(gid);
+    setfsuid(uid);
+    int fd = open(path, O_PATH | O_CLOEXEC | flags);
+    int err = errno;
+    setfsuid(geteuid());
+    setfsgid(getegid());
+    errno = err;
+    return fd;
+}
+
+// sorts the targets of ns_args into the ones that are to be mounted (a
+// bind: or union: source, or all of them with bind_all) and the ones that
+// stay symlinks. link_args gets ns_args with the prefixes dropped (and for a
+// union, only its first source), which is what the tree gets built from,
+// pointing into storage. A bind source the caller can't open stays a
+// symlink, as if it hadn't asked. A union member they can't open is an
+// error, since leaving it out would change which files win.
+int open_mount_sources(const char* progname, const std::vector<char*>& ns_args, bool bind_all, uid_t uid, gid_t gid,
+    std::vector<std::string>& storage, std::vector<char*>& link_args, std::vector<mount_target>& mounts)
+{
+    storage.assign(ns_args.begin(), ns_args.end());
+    for (std::vector<std::string>::iterator it = storage.begin() + 1, end = storage.end(); it != end; ++it)
     {
-        // split out the target=source
-        std::string target_source = *it;
-        size_t equal_index = target_source.find('=');
-        CHECK(equal_index != std::string::npos && target_source[equal_index + 1],
-            "%s argument %s is must be of the form target=src\n", progname, target_source.c_str());
-        const std::string target = target_source.substr(0, equal_index);
-        const std::string source = target_source.substr(equal_index + 1, std::string::npos);
+        size_t equal = it->find('=');
+        if (equal == std::string::npos)
+            continue;
+        mount_target target = { it->substr(0, equal), std::vector<int>(), false, false };
+        struct stat st;
+        if (prefixed_source(it->c_str(), UNION_PREFIX))
+        {
+            std::string sources = it->substr(equal + 1 + strlen(UNION_PREFIX));
+            it->erase(equal + 1);
+            it->append(sources, 0, sources.find(':'));
+            target.m_dir = true;
+            target.m_union = true;
+            mounts.push_back(target);
+            for (size_t start = 0; start <= sources.size(); )
+            {
+                size_t colon = std::min(sources.find(':', start), sources.size());
+                std::string source = sources.substr(start, colon - start);
+                int fd = open_as_caller(source.c_str(), uid, gid, O_DIRECTORY);
+                CHECK(fd >= 0, "%s: union member %s of %s can't be opened: %m\n", progname, source.c_str(),
+                    target.m_target.c_str());
+                mounts.back().m_source_fds.push_back(fd);
+                start = colon + 1;
+            }
+            continue;
+        }
+        else
+        {
+            bool bind = prefixed_source(it->c_str(), BIND_PREFIX) != NULL;
+            if (bind)
+                it->erase(equal + 1, strlen(BIND_PREFIX));
+            if (!bind && !bind_all)
+                continue;
+            int fd = open_as_caller(it->c_str() + equal + 1, uid, gid);
+            if (fd >= 0 && fstat(fd, &st) == 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+            {
+                target.m_dir = S_ISDIR(st.st_mode);
+                target.m_source_fds.push_back(fd);
+            }
+            else if (fd >= 0)
+                close(fd);
+        }
+        if (!target.m_source_fds.empty())
+            mounts.push_back(target);
+    }
 
-        // create dir for mount_path, if necessary
-        std::string mount_path = WITH_MOUNTPOINT "/" + target;
-        size_t path_end_index = mount_path.rfind('/');
-        if (path_end_index != std::string::npos)
+    link_args.clear();
+    for (std::vector<std::string>::iterator it = storage.begin(), end = storage.end(); it != end; ++it)
+        link_args.push_back(&(*it)[0]);
+    return 0;
+}
+
+void close_mount_sources(std::vector<mount_target>& mounts)
+{
+    for (std::vector<mount_target>::iterator it = mounts.begin(), end = mounts.end(); it != end; ++it)
+        for (std::vector<int>::const_iterator fd = it->m_source_fds.begin(); fd != it->m_source_fds.end(); ++fd)
+            close(*fd);
+}
+
+// swaps the symlink build_tree made for each of mounts for a directory or
+// file, and mounts its source (or the overlay of its sources) on that
+int mount_targets(const char* progname, const std::vector<mount_target>& mounts)
+{
+    for (std::vector<mount_target>::const_iterator it = mounts.begin(), end = mounts.end(); it != end; ++it)
+    {
+        std::string path = std::string(WITH_MOUNTPOINT "/") + it->m_target;
+        CHECK(unlink(path.c_str()) == 0, "%s: unlink %s failed: %m\n", progname, path.c_str());
+        int fd = it->m_dir ? mkdir(path.c_str(), 0755) : open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        CHECK(fd >= 0, "%s: create %s failed: %m\n", progname, path.c_str());
+        if (!it->m_dir)
+            close(fd);
+
+        char source[64];
+        if (it->m_source_fds.size() == 1)
         {
-            std::string dir_path = mount_path.substr(0, path_end_index);
-            int ret = mkdir_p(dir_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IRUSR | S_IXUSR | S_IROTH | S_IXOTH);
-            CHECK(ret >= 0 || errno == EEXIST, "%s: create %s failed: %m\n", progname, dir_path.c_str());
+            // overlayfs wants two lower directories if there's no upper one,
+            // so a union of one is a bind, made read-only. Like the overlay,
+            // it leaves out the mounts below the source.
+            snprintf(source, sizeof(source), "/proc/self/fd/%d", it->m_source_fds.front());
+            CHECK(mount(source, path.c_str(), NULL, it->m_union ? MS_BIND : MS_BIND | MS_REC, NULL) == 0,
+                "%s: bind mount on %s failed: %m\n", progname, path.c_str());
+            CHECK(!it->m_union || mount(NULL, path.c_str(), NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL) == 0,
+                "%s: remount %s read-only failed: %m\n", progname, path.c_str());
+            continue;
         }
 
-        // symlink
-        int ret = symlink(source.c_str(), mount_path.c_str());
-        CHECK(ret >= 0, "%s: symlink %s -> %s failed: %m\n", progname, mount_path.c_str(), source.c_str());
-    };
+        // overlayfs takes the lower directories top first; without an
+        // upper one the overlay is read-only
+        std::string options = "lowerdir=";
+        for (std::vector<int>::const_iterator fd = it->m_source_fds.begin(); fd != it->m_source_fds.end(); ++fd)
+        {
+            snprintf(source, sizeof(source), "%s/proc/self/fd/%d", fd == it->m_source_fds.begin() ? "" : ":", *fd);
+            options += source;
+        }
+        CHECK(mount("with-union", path.c_str(), "overlay", MS_RDONLY, options.c_str()) == 0,
+            "%s: overlay mount on %s failed: %m\n", progname, path.c_str());
+    }
+    return 0;
+}
 
-    // write the namespace metadata
-    FILE* fd = fopen(WITH_MOUNTPOINT "/.ns", "w");
-    CHECK(fd >= 0, "%s: unable to write namespace metadata: %m\n%s\n", progname, WITH_MOUNTPOINT "/.ns");
-    for (std::list<char*>::const_iterator it = ns_args.begin(), end = ns_args.end(); it != end; ++it)
-        fprintf(fd, "%s ", *it);
+// detach from our parent's namespace and build a fresh WITH_MOUNTPOINT from
+// ns_args (mount-name target1=src1 target2=src2 ...) and env_args. uid and
+// gid are the caller's, which bind targets are opened as.
+int setup_namespace(const char* progname, const std::vector<char*>& ns_args, const std::vector<char*>& env_args,
+    uid_t uid, gid_t gid)
+{
+    uint64_t t = trace_start();
+    bool userns = geteuid() != 0;
+    bool report = find_env(env_args, "WITH_BUILD_STATS") != NULL;
+
+    // find (or build) the prebuilt tree while we can still share it. The
+    // cache only has symlinks, so it's no good for mounted targets, and
+    // only root can add to it.
+    std::string cached_dir;
+    int cache_lock = -1;
+    bool cached = !userns && !wants_mount_targets(ns_args, env_args)
+        && find_cached_tree(progname, ns_args, report, cached_dir, cache_lock) == 0;
+    t = trace_phase("cached tree", t);
+
+    int ret = 0;
+    if (userns)
+        ret = unshare_user_namespace(progname);
+    else
+        CHECK(unshare(CLONE_NEWNS) == 0, "%s: unshare failed: %m\n", progname);
+    if (cache_lock >= 0)
+        close(cache_lock);
+    if (ret > 0)
+        return ret;
+    t = trace_phase("unshare", t);
+
+    // umount the old /with (this mount is now private for us)
+    // the MNT_DETACH is needed if some joker set getcwd() to /with.
+    // In a user namespace the mounts we got from our parent are locked
+    // together, so the old /with stays and the new one goes on top.
+    if (!userns)
+    {
+        CHECK(umount2(WITH_MOUNTPOINT, MNT_DETACH) >= 0, "%s: umount2 tmpfs " WITH_MOUNTPOINT " failed: %m\n", progname);
+        t = trace_phase("umount", t);
+    }
+
+    char* mount_name = ns_args.front();
+    assert(mount_name);
+    CHECK(mount(mount_name, "/with", "tmpfs", 0, NULL) >= 0, "%s: mount tmpfs " WITH_MOUNTPOINT " failed: %m\n", progname);
+    t = trace_phase("mount tmpfs", t);
+
+    // lay a writable overlay over the prebuilt tree, or build out the
+    // symlinks ourselves
+    std::vector<std::string> storage;
+    std::vector<char*> link_args;
+    std::vector<mount_target> mounts;
+    ret = open_mount_sources(progname, ns_args, find_env(env_args, BIND_ALL_ENV) != NULL, uid, gid, storage,
+        link_args, mounts);
+    if (ret != 0)
+    {
+        close_mount_sources(mounts);
+        return ret;
+    }
+    ret = -1;
+    if (cached)
+    {
+        ret = mount_cached_tree(progname, mount_name, cached_dir);
+        t = trace_phase("overlay cached tree", t);
+    }
+    if (ret < 0)
+    {
+        ret = create_symlinks(progname, WITH_MOUNTPOINT, link_args, report);
+        t = trace_phase("symlinks", t);
+    }
+    if (ret == 0 && !mounts.empty())
+    {
+        ret = mount_targets(progname, mounts);
+        t = trace_phase("target mounts", t);
+    }
+    close_mount_sources(mounts);
+    if (ret != 0)
+        return ret;
+
+    // write the metadata
+    ret = write_ns_metadata(progname, ns_args);
+    if (ret != 0)
+        return ret;
+    ret = write_env_metadata(progname, env_args);
+    if (ret != 0)
+        return ret;
+    ret = write_index_metadata(progname, ns_args, env_args);
+    trace_phase("metadata", t);
+    return ret;
+}
+
+// enters ns_fd, a namespace from the broker's pool which already has the
+// tree for ns_args mounted, and replaces the holder's metadata with ours
+int enter_pooled_namespace(const char* progname, int ns_fd, const std::vector<char*>& ns_args,
+    const std::vector<char*>& env_args)
+{
+    uint64_t t = trace_start();
+    CHECK(setns(ns_fd, CLONE_NEWNS) == 0, "%s: setns failed: %m\n", progname);
+    close(ns_fd);
+    t = trace_phase("setns pooled namespace", t);
+
+    int ret = write_ns_metadata(progname, ns_args);
+    if (ret != 0)
+        return ret;
+    ret = write_env_metadata(progname, env_args);
+    if (ret != 0)
+        return ret;
+    ret = write_index_metadata(progname, ns_args, env_args);
+    trace_phase("metadata", t);
+    return ret;
+}
+
+// drops to uid/gid, changes to cwd if given, installs env_args as the
+// environment and execs exec_args, which must be NULL terminated. only
+// returns on failure. This is where the trace gets written, since only now
+// can we open the file as the caller.
+int drop_privileges_and_exec(const char* progname, uid_t uid, gid_t gid,
+    const std::vector<char*>& env_args, const std::vector<char*>& exec_args, const char* cwd = NULL)
+{
+    uint64_t t = trace_start();
+    CHECK(setresgid(gid, gid, gid) >= 0 && setresuid(uid, uid, uid) >= 0,
+        "%s: setresuid/setresgid failed: %m\n", progname);
+    CHECK(!cwd || chdir(cwd) == 0, "%s: chdir %s failed: %m\n", progname, cwd);
+    t = trace_phase("drop privileges", t);
+
+    // now that we've dropped privileges, install the environment
+    // that was passed to us.
+    clearenv();
+    for (std::vector<char*>::const_iterator it = env_args.begin(), end = env_args.end(); it != end; ++it)
+    {
+        char* env_var = *it;
+        assert(env_var);
+        putenv(env_var);
+    }
+
+    // the execvp itself can't be timed from here; mark where it starts
+    trace.phase("exec_with_namespace", "execvp", t, t);
+    trace.flush();
+    CHECK(execvp(exec_args[0], &exec_args[0]) != -1, "%s: cannot exec %s: %m\n", progname, exec_args[0]);
+    return 1;
+}
+
+// true if every uid of the process at proc_fd (a /proc/<pid> directory) is
+// our real uid, or we were run by root
+bool owned_by_caller(int proc_fd)
+{
+    uid_t uid = getuid();
+    if (uid == 0)
+        return true;
+    int fd = openat(proc_fd, "status", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return false;
+    buf[len] = '\0';
+
+    const char* line = strstr(buf, "\nUid:");
+    unsigned long uids[4];
+    return line && sscanf(line, "\nUid: %lu %lu %lu %lu", &uids[0], &uids[1], &uids[2], &uids[3]) == 4
+        && uids[0] == uid && uids[1] == uid && uids[2] == uid && uids[3] == uid;
+}
+
+// true if the namespace fds a and b are the same namespace
+bool same_namespace(int a, int b)
+{
+    struct stat st_a, st_b;
+    return fstat(a, &st_a) == 0 && fstat(b, &st_b) == 0 && st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+// true if pid (whose /proc entry is proc_fd) and its mount namespace ns_fd
+// are both in our own user namespace. Anyone can make a mount namespace in
+// a user namespace of their own and mount what they like in it, so a
+// setuid helper must never setns() into one of those as root: the setuid
+// programs they then ran would find files of the caller's choosing.
+bool in_our_user_namespace(int proc_fd, int ns_fd)
+{
+    int ours = open("/proc/self/ns/user", O_RDONLY | O_CLOEXEC);
+    int theirs = openat(proc_fd, "ns/user", O_RDONLY | O_CLOEXEC);
+    int owner = ioctl(ns_fd, NS_GET_USERNS);
+    bool same = ours >= 0 && theirs >= 0 && owner >= 0 && same_namespace(ours, theirs) && same_namespace(ours, owner);
+    if (ours >= 0)
+        close(ours);
+    if (theirs >= 0)
+        close(theirs);
+    if (owner >= 0)
+        close(owner);
+    return same;
+}
+
+// --join=pid: switches to the mount namespace of pid instead of building
+// one. pid has to be one of the caller's processes, and its /with has to be
+// a with tmpfs (or an overlay on a cached tree). Everything is looked up
+// through one fd for /proc/<pid>, so if the pid gets recycled along the way
+// we fail rather than pick up some other process.
+//
+// When we're setuid root, the namespace also has to be one we built: in our
+// own user namespace, with a .ns that only root could have written.
+int join_namespace(const char* progname, const char* arg)
+{
+    char* end;
+    long pid = strtol(arg, &end, 10);
+    CHECK(*arg && !*end && pid > 0 && pid <= INT_MAX, "%s: bad --join pid %s\n", progname, arg);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld", pid);
+    int proc_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    CHECK(proc_fd >= 0, "%s: --join %ld failed: %m\n", progname, pid);
+    int ns_fd = openat(proc_fd, "ns/mnt", O_RDONLY | O_CLOEXEC);
+    CHECK(ns_fd >= 0, "%s: --join %ld failed: %m\n", progname, pid);
+    // checked after opening the namespace, so it can't be swapped in between
+    CHECK(owned_by_caller(proc_fd), "%s: --join %ld: not your process\n", progname, pid);
+    bool setuid = geteuid() == 0 && getuid() != 0;
+    CHECK(!setuid || in_our_user_namespace(proc_fd, ns_fd),
+        "%s: --join %ld: refusing to join a namespace from another user namespace\n", progname, pid);
+
+    int with_fd = openat(proc_fd, "root" WITH_MOUNTPOINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct statfs fs;
+    struct stat st;
+    CHECK(with_fd >= 0 && fstatfs(with_fd, &fs) == 0 && (fs.f_type == TMPFS_MAGIC || fs.f_type == OVERLAYFS_SUPER_MAGIC)
+        && fstatat(with_fd, ".ns", &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && (!setuid || st.st_uid == 0),
+        "%s: --join %ld: not in a with namespace\n", progname, pid);
+    close(with_fd);
+
+    // a namespace we built without setuid root lives in a user namespace,
+    // which we need to be in (and have the capabilities of) to join it
+    uint64_t t = trace_start();
+    if (geteuid() != 0)
+    {
+        int user_fd = openat(proc_fd, "ns/user", O_RDONLY | O_CLOEXEC);
+        CHECK(user_fd >= 0, "%s: --join %ld failed: %m\n", progname, pid);
+        CHECK(setns(user_fd, CLONE_NEWUSER) == 0, "%s: --join %ld: setns user namespace failed: %m\n", progname, pid);
+        close(user_fd);
+    }
+    close(proc_fd);
+
+    CHECK(setns(ns_fd, CLONE_NEWNS) == 0, "%s: setns failed: %m\n", progname);
+    close(ns_fd);
+    trace_phase("setns", t);
+    return 0;
+}
+
+// the mount name followed by the targets, as setup_namespace wants them
+std::vector<char*> spec_ns_args(spec_reader& spec)
+{
+    std::vector<char*> ns_args;
+    ns_args.reserve(1 + spec.section(SPEC_TARGETS).size());
+    ns_args.push_back(spec.section(SPEC_DEVNAME).front());
+    ns_args.insert(ns_args.end(), spec.section(SPEC_TARGETS).begin(), spec.section(SPEC_TARGETS).end());
+    return ns_args;
+}
+
+// --spec-fd=N: maps the spec blob in memfd N and parses it in place. The
+// memfd has to be sealed against writes and resizing, or the caller could
+// change it while we look at it. The mapping is private so spec can hand
+// out char*, and stays around until we exec.
+int map_spec_fd(const char* progname, const char* arg, spec_reader& spec)
+{
+    char* end;
+    long fd = strtol(arg, &end, 10);
+    CHECK(*arg && !*end && fd > STDERR_FILENO && fd <= INT_MAX, "%s: bad --spec-fd %s\n", progname, arg);
+
+    int seals = fcntl(fd, F_GET_SEALS);
+    CHECK(seals >= 0 && (seals & SPEC_FD_SEALS) == SPEC_FD_SEALS,
+        "%s: --spec-fd %ld is not a sealed memfd\n", progname, fd);
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= MAX_SPEC_SIZE,
+        "%s: bad spec in --spec-fd %ld\n", progname, fd);
+    void* blob = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    CHECK(blob != MAP_FAILED, "%s: mmap --spec-fd %ld failed: %m\n", progname, fd);
+    close(fd); // don't leak it into the command
+
+    CHECK(spec.parse(static_cast<char*>(blob), st.st_size) && !spec.section(SPEC_CMD).empty(),
+        "%s: bad spec in --spec-fd %ld\n", progname, fd);
+    return 0;
+}
+
+int read_full(int fd, void* buf, size_t len)
+{
+    char* p = static_cast<char*>(buf);
+    while (len > 0)
+    {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+void send_reply(int conn, int type, int value)
+{
+    broker_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.m_type = type;
+    reply.m_value = value;
+    ssize_t ret = send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+    (void)ret;
+}
+
+// a broker request, read a piece at a time by continue_broker_request and
+// handed to serve_broker_client
+struct broker_client
+{
+    broker_client() : m_got(0), m_deadline(0) { memset(m_fds, -1, sizeof(m_fds)); }
+    ~broker_client()
+    {
+        for (int i = 0; i < BROKER_NUM_FDS; ++i)
+            if (m_fds[i] >= 0)
+                close(m_fds[i]);
+    }
+
+    size_t m_got;           // of m_req; the spec read so far is in m_blob
+    uint64_t m_deadline;    // with_trace_now() by which it all has to be here
+    struct ucred m_cred;
+    std::vector<gid_t> m_groups;
+    broker_request m_req;
+    int m_fds[BROKER_NUM_FDS]; // the client's stdin, stdout, stderr and cwd
+    std::vector<char> m_blob;
+    spec_reader m_spec; // points into m_blob
+
+private:
+    broker_client(const broker_client&);
+    broker_client& operator=(const broker_client&);
+};
+
+// moves us into the cgroup v2 directory of pid, if we can. A job started
+// by the broker would otherwise be accounted to the broker's cgroup.
+void join_cgroup_of(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", int(pid));
+    FILE* fd = fopen(path, "r");
+    if (!fd)
+        return;
+    char line[PATH_MAX];
+    std::string dir;
+    while (dir.empty() && fgets(line, sizeof(line), fd))
+        if (strncmp(line, "0::/", 4) == 0)
+            dir.assign(line + 3, strcspn(line + 3, "\n"));
     fclose(fd);
+    if (dir.empty())
+        return;
+    int procs = open(("/sys/fs/cgroup" + dir + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (procs < 0)
+        return;
+    ssize_t ret = write(procs, "0", 1);
+    (void)ret;
+    close(procs);
+}
+
+// gives us the resource limits and cgroup of the client at the other end of
+// conn, instead of the broker's. They're read from the kernel rather than
+// sent in the request, so a client can't raise its own. Fails if the client
+// hangs up meanwhile, since its pid may then belong to someone else.
+int adopt_client_limits(const char* progname, int conn, pid_t pid)
+{
+    for (int r = 0; r < RLIM_NLIMITS; ++r)
+    {
+        struct rlimit lim;
+        __rlimit_resource resource = __rlimit_resource(r);
+        CHECK(prlimit(pid, resource, NULL, &lim) == 0 && setrlimit(resource, &lim) == 0,
+            "%s: copying resource limit %d of pid %d failed: %m\n", progname, r, int(pid));
+    }
+    join_cgroup_of(pid);
 
+    struct pollfd pfd = { conn, POLLRDHUP, 0 };
+    CHECK(poll(&pfd, 1, 0) == 0, "%s: pid %d went away\n", progname, int(pid));
     return 0;
 }
 
+// runs in the job process forked by serve_broker_client: the same steps as
+// main() below, but with the identity, stdio, cwd, umask, resource limits
+// and cgroup of the client. If ns_fd is a namespace from the pool, uses that
+// instead of building one.
+int start_broker_job(const char* progname, int conn, broker_client& client, int ns_fd)
+{
+    uint64_t job_start = with_trace_now();
+    // from here on our complaints go to the client, just like the setuid path
+    for (int i = 0; i < 3; ++i)
+        CHECK(dup2(client.m_fds[i], i) == i, "%s: dup2 failed: %m\n", progname);
+    CHECK(setsid() >= 0, "%s: setsid failed: %m\n", progname);
+
+    // the client's groups go in first, so bind targets get opened with
+    // them, as they would be by the setuid helper
+    std::vector<gid_t>& groups = client.m_groups;
+    CHECK(setgroups(groups.size(), groups.empty() ? NULL : &groups[0]) >= 0,
+        "%s: setgroups failed: %m\n", progname);
+
+    spec_reader& spec = client.m_spec;
+    const struct ucred& cred = client.m_cred;
+    start_trace(spec.section(SPEC_ENV), "broker job", job_start);
+    int ret = ns_fd >= 0 ? enter_pooled_namespace(progname, ns_fd, spec_ns_args(spec), spec.section(SPEC_ENV))
+        : setup_namespace(progname, spec_ns_args(spec), spec.section(SPEC_ENV), cred.uid, cred.gid);
+    if (ret != 0)
+        return ret;
+
+    ret = adopt_client_limits(progname, conn, cred.pid);
+    close(conn);
+    if (ret != 0)
+        return ret;
+    umask(client.m_req.m_umask);
+
+    // the chdir has to happen with the client's credentials
+    CHECK(setresgid(cred.gid, cred.gid, cred.gid) >= 0 && setresuid(cred.uid, cred.uid, cred.uid) >= 0,
+        "%s: setresuid/setresgid failed: %m\n", progname);
+    CHECK(fchdir(client.m_fds[3]) == 0, "%s: fchdir failed: %m\n", progname);
+
+    std::vector<char*> exec_args(spec.section(SPEC_CMD));
+    exec_args.push_back(NULL);
+    return drop_privileges_and_exec(progname, cred.uid, cred.gid, spec.section(SPEC_ENV), exec_args);
+}
+
+// what continue_broker_request makes of a connection so far
+enum broker_request_state
+{
+    REQUEST_JOB,        // a whole job request has arrived
+    REQUEST_STATS,      // it's a stats request
+    REQUEST_PENDING,    // there's more to come
+    REQUEST_BAD         // it's no good, and we've complained
+};
+
+// starts on the request of a new broker connection: finds out who sent it
+// and when they have to be done by. Returns nonzero (after complaining) if
+// we can't tell.
+int start_broker_request(const char* progname, int conn, broker_client& client)
+{
+    client.m_deadline = with_trace_now() + BROKER_REQUEST_TIMEOUT;
+    struct ucred& cred = client.m_cred;
+    socklen_t len = sizeof(cred);
+    CHECK(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0,
+        "%s: SO_PEERCRED failed: %m\n", progname);
+
+    std::vector<gid_t>& groups = client.m_groups;
+    groups.resize(NGROUPS_MAX);
+    len = groups.size() * sizeof(gid_t);
+    CHECK(getsockopt(conn, SOL_SOCKET, SO_PEERGROUPS, &groups[0], &len) == 0,
+        "%s: SO_PEERGROUPS failed: %m\n", progname);
+    groups.resize(len / sizeof(gid_t));
+    return 0;
+}
+
+// true if pid, the client at the other end of conn, is in the broker's own
+// mount namespace. A job gets unshared from ours, so one for a client in a
+// mount namespace of its own (a container, or an unshare -m) would see our
+// mounts instead of the ones the client resolved its paths and cwd in.
+bool in_our_mount_namespace(int conn, pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", int(pid));
+    int ours = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    int theirs = open(path, O_RDONLY | O_CLOEXEC);
+    bool same = ours >= 0 && theirs >= 0 && same_namespace(ours, theirs);
+    if (ours >= 0)
+        close(ours);
+    if (theirs >= 0)
+        close(theirs);
+    // the client waits for our reply, so if it's still connected, pid
+    // hasn't been reused for somebody else
+    struct pollfd pfd = { conn, POLLRDHUP, 0 };
+    return same && poll(&pfd, 1, 0) == 0;
+}
+
+// reads whatever more of the request on conn has arrived, without
+// blocking. First comes the request header, carrying the client's stdio
+// and cwd, then the spec blob.
+broker_request_state continue_broker_request(const char* progname, int conn, broker_client& client)
+{
+    const struct ucred& cred = client.m_cred;
+    broker_request& req = client.m_req;
+    while (client.m_got < sizeof(req))
+    {
+        // the fds come along with the first byte
+        char cmsgbuf[CMSG_SPACE(BROKER_NUM_FDS * sizeof(int))];
+        struct iovec iov = { reinterpret_cast<char*>(&req) + client.m_got, sizeof(req) - client.m_got };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = client.m_got == 0 ? cmsgbuf : NULL;
+        msg.msg_controllen = client.m_got == 0 ? sizeof(cmsgbuf) : 0;
+        ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+            return REQUEST_PENDING;
+        if (got <= 0)
+        {
+            fprintf(stderr, "%s: pid %d hung up before finishing its request\n", progname, int(cred.pid));
+            return REQUEST_BAD;
+        }
+        struct cmsghdr* cmsg = client.m_got == 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len <= CMSG_LEN(BROKER_NUM_FDS * sizeof(int)))
+            memcpy(client.m_fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+        client.m_got += got;
+    }
+    if (req.m_magic == WITH_BROKER_STATS_MAGIC)
+        return REQUEST_STATS;
+    if (req.m_magic != WITH_BROKER_MAGIC)
+    {
+        fprintf(stderr, "%s: bad request from pid %d\n", progname, int(cred.pid));
+        return REQUEST_BAD;
+    }
+    for (int i = 0; i < BROKER_NUM_FDS; ++i)
+    {
+        if (client.m_fds[i] < 0)
+        {
+            fprintf(stderr, "%s: request from pid %d is missing its fds\n", progname, int(cred.pid));
+            return REQUEST_BAD;
+        }
+    }
+
+    // the spec's own header says how long it is
+    std::vector<char>& blob = client.m_blob;
+    while (true)
+    {
+        size_t want = 2 * sizeof(uint32_t);
+        if (blob.size() >= want)
+        {
+            uint32_t header[2];
+            memcpy(header, &blob[0], sizeof(header));
+            if (header[1] < sizeof(header) || header[1] > BROKER_MAX_SPEC_SIZE)
+            {
+                fprintf(stderr, "%s: bad spec from pid %d\n", progname, int(cred.pid));
+                return REQUEST_BAD;
+            }
+            want = header[1];
+        }
+        if (blob.size() == want && blob.size() > 2 * sizeof(uint32_t))
+            break;
+
+        char buf[65536];
+        ssize_t got = recv(conn, buf, std::min(sizeof(buf), want - blob.size()), MSG_DONTWAIT);
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+            return REQUEST_PENDING;
+        if (got <= 0)
+        {
+            fprintf(stderr, "%s: pid %d hung up before finishing its request\n", progname, int(cred.pid));
+            return REQUEST_BAD;
+        }
+        blob.insert(blob.end(), buf, buf + got);
+    }
+
+    spec_reader& spec = client.m_spec;
+    if (!spec.parse(&blob[0], blob.size()) || spec.section(SPEC_CMD).empty() || spec.section(SPEC_DEVNAME).size() != 1)
+    {
+        fprintf(stderr, "%s: bad spec from pid %d\n", progname, int(cred.pid));
+        return REQUEST_BAD;
+    }
+    if (!in_our_mount_namespace(conn, cred.pid))
+    {
+        // hanging up without a reply sends the client to the setuid helper
+        fprintf(stderr, "%s: pid %d is in another mount namespace, leaving it to the helper\n", progname, int(cred.pid));
+        return REQUEST_BAD;
+    }
+    return REQUEST_JOB;
+}
+
+// waits for the job pid to exit and returns its wait status. If the client
+// at the other end of conn hangs up first (it got killed, say), kills the
+// job's session instead, since nobody is left to collect its status.
+int wait_for_job(const char* progname, int conn, pid_t pid)
+{
+    // without pidfds (before linux 5.3), check on the job every second
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    int status;
+    while (true)
+    {
+        struct pollfd pfds[2] = { { conn, POLLRDHUP, 0 }, { pidfd, POLLIN, 0 } };
+        int ready = poll(pfds, 2, pidfd >= 0 ? -1 : 1000);
+        CHECK(ready >= 0 || errno == EINTR, "%s: poll failed: %m\n", progname);
+        pid_t ret = waitpid(pid, &status, WNOHANG);
+        CHECK(ret >= 0 || errno == EINTR, "%s: waitpid failed: %m\n", progname);
+        if (ret == pid)
+            break;
+        if (ready > 0 && pfds[0].revents)
+        {
+            kill(-pid, SIGKILL);
+            kill(pid, SIGKILL);
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            status = -1;
+            break;
+        }
+    }
+    if (pidfd >= 0)
+        close(pidfd);
+    return status;
+}
+
+// handles one broker connection, in its own process. Starts the job, tells
+// the client its pid, waits for it and passes back the wait status.
+int serve_broker_client(const char* progname, int conn, broker_client& client, int ns_fd)
+{
+    // the job reports setup failures through errpipe; a successful exec
+    // closes it without writing anything
+    int errpipe[2];
+    CHECK(pipe2(errpipe, O_CLOEXEC) == 0, "%s: pipe failed: %m\n", progname);
+    pid_t pid = fork();
+    CHECK(pid >= 0, "%s: fork failed: %m\n", progname);
+    if (pid == 0)
+    {
+        close(errpipe[0]);
+        int ret = start_broker_job(progname, conn, client, ns_fd);
+        char c = 1;
+        ssize_t written = write(errpipe[1], &c, 1);
+        (void)written;
+        _exit(ret);
+    }
+    close(errpipe[1]);
+    if (ns_fd >= 0)
+        close(ns_fd);
+
+    char c;
+    ssize_t failed;
+    while ((failed = read(errpipe[0], &c, 1)) < 0 && errno == EINTR)
+        ;
+    if (failed != 0)
+    {
+        waitpid(pid, NULL, 0);
+        send_reply(conn, BROKER_FAILED, 1);
+        return 1;
+    }
+    send_reply(conn, BROKER_STARTED, pid);
+
+    int status = wait_for_job(progname, conn, pid);
+    if (status != -1)
+        send_reply(conn, BROKER_EXITED, status);
+    return 0;
+}
+
+// The broker's pool of warm namespaces. Unsharing copies the whole mount
+// table, so for each canonical spec (see canonical_spec()) that clients
+// have asked for recently, the broker keeps a few namespaces with the tree
+// already mounted. A job with a matching spec just setns()es into one and
+// writes its own .ns, .env and .index over the holder's.
+//
+// Each namespace is built by a short-lived holder process, which says so
+// on its socket and then waits for us to hang up. By then we have an fd for
+// its ns/mnt, which is what keeps the namespace around. The tmpfs at /with
+// carries the mount name, so namespaces are pooled per mount name as well
+// as per spec.
+struct pool_holder
+{
+    pid_t m_pid;
+    int m_sock;
+};
+
+struct pool_spec
+{
+    pool_spec() : m_last_used(0), m_hits(0), m_misses(0) {}
+
+    std::string m_devname;
+    std::string m_spec;             // canonical
+    std::deque<int> m_ready;        // ns/mnt fds
+    std::vector<pool_holder> m_building;
+    time_t m_last_used;
+    unsigned long m_hits, m_misses;
+};
+
+struct broker_pool
+{
+    broker_pool() : m_size(POOL_DEFAULT_SIZE), m_idle(POOL_DEFAULT_IDLE), m_hits(0), m_misses(0), m_evicted(0) {}
+
+    size_t m_size;
+    time_t m_idle;
+    std::map<std::string, pool_spec> m_specs; // by hash_spec() of the mount name and spec
+    unsigned long m_hits, m_misses, m_evicted; // since we started
+};
+
+// in a process forked by the broker: lets go of the pool's fds, so holders
+// see us hang up and the namespaces get dropped when the broker says so
+void close_pool_fds(broker_pool& pool)
+{
+    for (std::map<std::string, pool_spec>::iterator it = pool.m_specs.begin(), end = pool.m_specs.end(); it != end; ++it)
+    {
+        for (std::deque<int>::const_iterator fd = it->second.m_ready.begin(); fd != it->second.m_ready.end(); ++fd)
+            close(*fd);
+        for (std::vector<pool_holder>::const_iterator h = it->second.m_building.begin(); h != it->second.m_building.end(); ++h)
+            close(h->m_sock);
+    }
+}
+
+void drop_pool_spec(pool_spec& spec)
+{
+    for (std::deque<int>::const_iterator fd = spec.m_ready.begin(), end = spec.m_ready.end(); fd != end; ++fd)
+        close(*fd);
+    for (std::vector<pool_holder>::const_iterator h = spec.m_building.begin(), end = spec.m_building.end(); h != end; ++h)
+        close(h->m_sock);
+}
+
+// forks a holder building a namespace for spec
+void start_pool_holder(const char* progname, broker_pool& pool, pool_spec& spec)
+{
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) != 0)
+    {
+        fprintf(stderr, "%s: socketpair failed: %m\n", progname);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close_pool_fds(pool);
+        close(socks[0]);
+        std::vector<char*> ns_args(1, const_cast<char*>(spec.m_devname.c_str()));
+        for (size_t i = 0; i < spec.m_spec.size(); i += strlen(&spec.m_spec[i]) + 1)
+            ns_args.push_back(&spec.m_spec[i]);
+        if (setup_namespace(progname, ns_args, std::vector<char*>(), 0, 0) != 0)
+            _exit(1);
+        char c = 1;
+        if (send(socks[1], &c, 1, MSG_NOSIGNAL) == 1)
+            while (read(socks[1], &c, 1) != 0 && errno == EINTR)
+                ;
+        _exit(0);
+    }
+    close(socks[1]);
+    if (pid < 0)
+    {
+        fprintf(stderr, "%s: fork failed: %m\n", progname);
+        close(socks[0]);
+        return;
+    }
+    pool_holder holder = { pid, socks[0] };
+    spec.m_building.push_back(holder);
+}
+
+// a holder's socket is readable: it's either done or died trying
+void finish_pool_holder(pool_spec& spec, size_t i)
+{
+    pool_holder holder = spec.m_building[i];
+    spec.m_building.erase(spec.m_building.begin() + i);
+
+    char c;
+    if (read(holder.m_sock, &c, 1) == 1)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/ns/mnt", int(holder.m_pid));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+            spec.m_ready.push_back(fd);
+    }
+    close(holder.m_sock); // the holder exits
+}
+
+// drops the specs nobody has asked for in a while
+void expire_pool(broker_pool& pool, time_t now)
+{
+    for (std::map<std::string, pool_spec>::iterator it = pool.m_specs.begin(); it != pool.m_specs.end(); )
+    {
+        if (now - it->second.m_last_used < pool.m_idle)
+        {
+            ++it;
+            continue;
+        }
+        pool.m_evicted += it->second.m_ready.size();
+        drop_pool_spec(it->second);
+        pool.m_specs.erase(it++);
+    }
+}
+
+// takes a namespace for ns_args out of the pool, or returns -1 if there is
+// none ready. Either way, starts building more for next time.
+int take_pooled_namespace(const char* progname, broker_pool& pool, const std::vector<char*>& ns_args)
+{
+    if (pool.m_size == 0)
+        return -1;
+
+    std::vector<char*> sorted_args;
+    std::string devname = ns_args[0], canonical = canonical_spec(ns_args, sorted_args);
+    std::string hash = hash_spec(devname + '\0' + canonical);
+    std::map<std::string, pool_spec>::iterator it = pool.m_specs.find(hash);
+    if (it == pool.m_specs.end())
+    {
+        // make room by dropping the least recently used spec
+        if (pool.m_specs.size() >= POOL_MAX_SPECS)
+        {
+            std::map<std::string, pool_spec>::iterator oldest = pool.m_specs.begin();
+            for (std::map<std::string, pool_spec>::iterator i = pool.m_specs.begin(); i != pool.m_specs.end(); ++i)
+                if (i->second.m_last_used < oldest->second.m_last_used)
+                    oldest = i;
+            pool.m_evicted += oldest->second.m_ready.size();
+            drop_pool_spec(oldest->second);
+            pool.m_specs.erase(oldest);
+        }
+        it = pool.m_specs.insert(std::make_pair(hash, pool_spec())).first;
+        it->second.m_devname = devname;
+        it->second.m_spec = canonical;
+    }
+    pool_spec& spec = it->second;
+    if (spec.m_devname != devname || spec.m_spec != canonical)
+        return -1; // a hash collision; leave the pool to the first spec
+
+    spec.m_last_used = time(NULL);
+    int fd = -1;
+    if (spec.m_ready.empty())
+    {
+        ++spec.m_misses;
+        ++pool.m_misses;
+    }
+    else
+    {
+        ++spec.m_hits;
+        ++pool.m_hits;
+        fd = spec.m_ready.front();
+        spec.m_ready.pop_front();
+    }
+    while (spec.m_ready.size() + spec.m_building.size() < pool.m_size)
+    {
+        size_t building = spec.m_building.size();
+        start_pool_holder(progname, pool, spec);
+        if (spec.m_building.size() == building)
+            break;
+    }
+    return fd;
+}
+
+// answers --broker-stats with a line per spec in the pool
+void send_pool_stats(int conn, const broker_pool& pool, time_t now)
+{
+    std::string out;
+    char line[256];
+    snprintf(line, sizeof(line), "pool size %lu, idle %lds, %lu specs\n",
+        (unsigned long)pool.m_size, long(pool.m_idle), (unsigned long)pool.m_specs.size());
+    out += line;
+    for (std::map<std::string, pool_spec>::const_iterator it = pool.m_specs.begin(), end = pool.m_specs.end(); it != end; ++it)
+    {
+        const pool_spec& spec = it->second;
+        snprintf(line, sizeof(line), "%s %s ready %lu building %lu hits %lu misses %lu idle %lds\n",
+            it->first.c_str(), spec.m_devname.c_str(), (unsigned long)spec.m_ready.size(), (unsigned long)spec.m_building.size(),
+            spec.m_hits, spec.m_misses, long(now - spec.m_last_used));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "total hits %lu misses %lu evicted %lu\n", pool.m_hits, pool.m_misses, pool.m_evicted);
+    out += line;
+    ssize_t ret = send(conn, out.data(), out.size(), MSG_NOSIGNAL);
+    (void)ret;
+}
+
+// forks a serve_broker_client for the request which has arrived on conn,
+// from a namespace in the pool if there's one ready. The child doesn't
+// hang on to the listening socket, the pool or other clients' connections,
+// so none of them stay open on our account after we're done with them.
+void start_broker_client(const char* progname, int sock, int conn, broker_client& client, broker_pool& pool,
+    const std::map<int, broker_client*>& pending)
+{
+    // mounted targets have to be opened as the client, which a pooled
+    // namespace wasn't
+    std::vector<char*> ns_args = spec_ns_args(client.m_spec);
+    int ns_fd = wants_mount_targets(ns_args, client.m_spec.section(SPEC_ENV)) ? -1
+        : take_pooled_namespace(progname, pool, ns_args);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sock);
+        close_pool_fds(pool);
+        for (std::map<int, broker_client*>::const_iterator it = pending.begin(), end = pending.end(); it != end; ++it)
+        {
+            close(it->first);
+            delete it->second;
+        }
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        _exit(serve_broker_client(progname, conn, client, ns_fd));
+    }
+    if (pid < 0)
+        fprintf(stderr, "%s: fork failed: %m\n", progname);
+    if (ns_fd >= 0)
+        close(ns_fd);
+}
+
+// --broker: listen on socket_path and read requests from its connections
+// as they arrive, forking a serve_broker_client for each one. This saves clients the setuid execve of this helper.
+int run_broker(const char* progname, const char* socket_path, broker_pool& pool)
+{
+    CHECK(getuid() == 0, "%s: --broker must be started by root\n", progname);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    CHECK(strlen(socket_path) < sizeof(addr.sun_path), "%s: socket path %s is too long\n", progname, socket_path);
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK(sock >= 0, "%s: socket failed: %m\n", progname);
+    unlink(socket_path);
+    CHECK(bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0,
+        "%s: bind %s failed: %m\n", progname, socket_path);
+    CHECK(chmod(socket_path, 0666) == 0, "%s: chmod %s failed: %m\n", progname, socket_path);
+    CHECK(listen(sock, SOMAXCONN) == 0, "%s: listen failed: %m\n", progname);
+
+    // connection handlers and pool holders get reaped automatically
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    // connections whose requests are still on their way, by fd
+    std::map<int, broker_client*> pending;
+    std::map<uid_t, size_t> pending_by_uid;
+    while (true)
+    {
+        // wait for a connection, more of a request or a holder, waking up
+        // now and then to expire idle specs and slow requests
+        uint64_t now = with_trace_now();
+        int timeout = 1000;
+        std::vector<struct pollfd> pfds(1);
+        std::vector<std::pair<pool_spec*, size_t> > holders;
+        pfds[0].fd = pending.size() < BROKER_MAX_PENDING ? sock : -1;
+        pfds[0].events = POLLIN;
+        for (std::map<std::string, pool_spec>::iterator it = pool.m_specs.begin(); it != pool.m_specs.end(); ++it)
+        {
+            for (size_t i = 0; i < it->second.m_building.size(); ++i)
+            {
+                struct pollfd pfd = { it->second.m_building[i].m_sock, POLLIN, 0 };
+                pfds.push_back(pfd);
+                holders.push_back(std::make_pair(&it->second, i));
+            }
+        }
+        for (std::map<int, broker_client*>::const_iterator it = pending.begin(), end = pending.end(); it != end; ++it)
+        {
+            struct pollfd pfd = { it->first, POLLIN, 0 };
+            pfds.push_back(pfd);
+            uint64_t deadline = it->second->m_deadline;
+            timeout = std::min(timeout, deadline > now ? int((deadline - now + 999) / 1000) : 0);
+        }
+        int ready = poll(&pfds[0], pfds.size(), timeout);
+        CHECK(ready >= 0 || errno == EINTR, "%s: poll failed: %m\n", progname);
+
+        // finish holders from the back, so the indexes stay good
+        for (size_t i = holders.size(); ready > 0 && i > 0; --i)
+            if (pfds[i].revents)
+                finish_pool_holder(*holders[i - 1].first, holders[i - 1].second);
+        expire_pool(pool, time(NULL));
+
+        // read what there is of the pending requests, and act on the ones
+        // which are done. Clients which are too slow get dropped.
+        now = with_trace_now();
+        for (size_t i = 1 + holders.size(); i < pfds.size(); ++i)
+        {
+            int conn = pfds[i].fd;
+            broker_client* client = pending[conn];
+            broker_request_state state = ready > 0 && pfds[i].revents
+                ? continue_broker_request(progname, conn, *client) : REQUEST_PENDING;
+            if (state == REQUEST_PENDING && now < client->m_deadline)
+                continue;
+            if (state == REQUEST_PENDING)
+                fprintf(stderr, "%s: pid %d took too long to send its request\n", progname, int(client->m_cred.pid));
+            pending.erase(conn);
+            if (--pending_by_uid[client->m_cred.uid] == 0)
+                pending_by_uid.erase(client->m_cred.uid);
+            if (state == REQUEST_STATS)
+                send_pool_stats(conn, pool, time(NULL));
+            else if (state == REQUEST_JOB)
+                start_broker_client(progname, sock, conn, *client, pool, pending);
+            delete client;
+            close(conn);
+        }
+
+        if (ready <= 0 || !pfds[0].revents)
+            continue;
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            CHECK(errno == EINTR || errno == EAGAIN || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE,
+                "%s: accept failed: %m\n", progname);
+            continue;
+        }
+        broker_client* client = new broker_client;
+        if (start_broker_request(progname, conn, *client) != 0
+            || pending_by_uid[client->m_cred.uid] >= BROKER_MAX_PENDING_PER_UID)
+        {
+            if (pending_by_uid[client->m_cred.uid] >= BROKER_MAX_PENDING_PER_UID)
+                fprintf(stderr, "%s: too many requests on the way from uid %d\n", progname, int(client->m_cred.uid));
+            delete client;
+            close(conn);
+            continue;
+        }
+        ++pending_by_uid[client->m_cred.uid];
+        pending[conn] = client;
+    }
+}
+
+// --broker-stats: prints what the broker at socket_path says about its pool
+int show_broker_stats(const char* progname, const char* socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    CHECK(strlen(socket_path) < sizeof(addr.sun_path), "%s: socket path %s is too long\n", progname, socket_path);
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK(sock >= 0, "%s: socket failed: %m\n", progname);
+    CHECK(connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0,
+        "%s: connect %s failed: %m\n", progname, socket_path);
+    broker_request req = { WITH_BROKER_STATS_MAGIC, 0 };
+    CHECK(send(sock, &req, sizeof(req), MSG_NOSIGNAL) == sizeof(req), "%s: send failed: %m\n", progname);
+
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(sock, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, len, stdout);
+    close(sock);
+    return len == 0 ? 0 : 1;
+}
+
 int main(int argc, char** argv)
 {
+    uint64_t main_start = with_trace_now();
     const char* progname = basename(strdup(argv[0]));
     if (argc <= 1)
         return usage(progname);
@@ -104,75 +1693,113 @@ int main(int argc, char** argv)
     // special case -- if the first arg is "--init.d", then we just build symlinks
     if (strcmp(argv[1], "--init.d") == 0)
     {
-        std::list<char*> ns_args;
-        for (int i = 1; i < argc; ++i)
-            ns_args.push_back(argv[i]);
-        int ret = create_symlinks_and_metadata(progname, ns_args);
+        std::vector<char*> ns_args(argv + 1, argv + argc);
+        int ret = create_symlinks_and_metadata(progname, ns_args, getenv("WITH_BUILD_STATS") != NULL);
         return ret;
     }
 
+    if (strcmp(argv[1], "--broker") == 0)
+    {
+        const char* socket_path = WITH_BROKER_SOCKET;
+        broker_pool pool;
+        for (int i = 2; i < argc; ++i)
+        {
+            char* end = NULL;
+            if (strncmp(argv[i], "--pool-size=", strlen("--pool-size=")) == 0)
+                pool.m_size = strtoul(argv[i] + strlen("--pool-size="), &end, 10);
+            else if (strncmp(argv[i], "--pool-idle=", strlen("--pool-idle=")) == 0)
+                pool.m_idle = strtoul(argv[i] + strlen("--pool-idle="), &end, 10);
+            else if (argv[i][0] != '-')
+                socket_path = argv[i];
+            if (argv[i][0] == '-' && (!end || *end))
+                return usage(progname);
+        }
+        return run_broker(progname, socket_path, pool);
+    }
+
+    if (strcmp(argv[1], "--broker-stats") == 0)
+        return show_broker_stats(progname, argc > 2 ? argv[2] : WITH_BROKER_SOCKET);
+
+    // --join=pid --spec-fd=N, or --join=pid cmd args... -- env
+    if (strncmp(argv[1], "--join=", strlen("--join=")) == 0)
+    {
+        spec_reader spec;
+        std::vector<char*> env_args, exec_args;
+        if (argc == 3 && strncmp(argv[2], "--spec-fd=", strlen("--spec-fd=")) == 0)
+        {
+            int ret = map_spec_fd(progname, argv[2] + strlen("--spec-fd="), spec);
+            if (ret != 0)
+                return ret;
+            CHECK(spec.section(SPEC_DEVNAME).empty() && spec.section(SPEC_TARGETS).empty(),
+                "%s: --join takes no targets\n", progname);
+            env_args.swap(spec.section(SPEC_ENV));
+            exec_args.swap(spec.section(SPEC_CMD));
+        }
+        else
+        {
+            int i = argc - 1;
+            while (i > 1 && strcmp(argv[i], "--") != 0)
+                i--;
+            if (i <= 2)
+                return usage(progname);
+            env_args.assign(argv + i + 1, argv + argc);
+            exec_args.assign(argv + 2, argv + i);
+        }
+        exec_args.push_back(NULL);
+        start_trace(env_args, "parse arguments", main_start);
+
+        // setns puts us at the root of the namespace; we want to stay where we are
+        char cwd[PATH_MAX];
+        CHECK(getcwd(cwd, sizeof(cwd)) != NULL, "%s: getcwd failed: %m\n", progname);
+        int ret = join_namespace(progname, argv[1] + strlen("--join="));
+        if (ret != 0)
+            return ret;
+        return drop_privileges_and_exec(progname, getuid(), getgid(), env_args, exec_args, cwd);
+    }
+
+    // everything we need is in the memfd, argv is just this one flag
+    if (strncmp(argv[1], "--spec-fd=", strlen("--spec-fd=")) == 0)
+    {
+        if (argc != 2)
+            return usage(progname);
+        spec_reader spec;
+        int ret = map_spec_fd(progname, argv[1] + strlen("--spec-fd="), spec);
+        if (ret != 0)
+            return ret;
+        CHECK(spec.section(SPEC_DEVNAME).size() == 1, "%s: bad spec in %s\n", progname, argv[1]);
+        start_trace(spec.section(SPEC_ENV), "read spec", main_start);
+        ret = setup_namespace(progname, spec_ns_args(spec), spec.section(SPEC_ENV), getuid(), getgid());
+        if (ret != 0)
+            return ret;
+        std::vector<char*>& exec_args = spec.section(SPEC_CMD);
+        exec_args.push_back(NULL);
+        return drop_privileges_and_exec(progname, getuid(), getgid(), spec.section(SPEC_ENV), exec_args);
+    }
+
     // Search **backwards** from the end of the commandline for --
     //     from end to 1st -- is the environment args (env_args)
     //     up to 2nd -- is the with namespace args (ns_args)
     //     rest is the command args (exec_args)
-    // This also means you need to push to **front**, not **back**.
-    std::list<char*> env_args, ns_args, exec_args;
-    int i = argc - 1; // start at 1 since 0 is progname
+    std::vector<char*> env_args, ns_args, exec_args;
+    int env_end = argc, i = argc - 1; // stop at 1 since 0 is progname
     while (i > 0 && strcmp(argv[i], "--") != 0)
-        env_args.push_front(argv[i--]);
-    i--; // skip --
+        i--;
+    env_args.assign(argv + i + 1, argv + env_end);
+    int ns_end = i--; // skip --
     while (i > 0 && strcmp(argv[i], "--") != 0)
-        ns_args.push_front(argv[i--]);
-    if (ns_args.size() == 0) // must at least have mount name
+        i--;
+    if (i <= 0 || ns_end - i <= 1) // must at least have mount name
         return usage(progname);
-    i--; // skip --
-    while (i > 0)
-        exec_args.push_front(argv[i--]);
+    ns_args.assign(argv + i + 1, argv + ns_end);
+    exec_args.assign(argv + 1, argv + i);
     exec_args.push_back(NULL); // execvp requires final argument be NULL
+    start_trace(env_args, "parse arguments", main_start);
 
-    // detach from our parent's namespace
-    CHECK(unshare(CLONE_NEWNS) == 0, "%s: unshare failed: %m\n", progname);
-
-    // umount the old /with (this mount is now private for us)
-    // the MNT_DETACH is needed if some joker set getcwd() to /with.
-    int ret = umount2(WITH_MOUNTPOINT, MNT_DETACH);
-    CHECK(ret >= 0, "%s: umount2 tmpfs " WITH_MOUNTPOINT " failed: %m\n", progname);
-
-    // after the -- is mount_name target1=src1 target2=src2 -- env
-    char* mount_name = ns_args.front();
-    assert(mount_name);
-    ret = mount(mount_name, "/with", "tmpfs", 0, NULL);
-    CHECK(ret >= 0, "%s: mount tmpfs " WITH_MOUNTPOINT " failed: %m\n", progname);
-
-    // build out the symlinks from the namespace
-    ret = create_symlinks_and_metadata(progname, ns_args);
+    // detach from our parent's namespace and build out the symlinks
+    int ret = setup_namespace(progname, ns_args, env_args, getuid(), getgid());
     if (ret != 0)  // CHECKs are performed in the function
         return ret;
 
-    // write env metadata
-    FILE* fd = fopen(WITH_MOUNTPOINT "/.env", "w");
-    CHECK(fd >= 0, "%s: unable to write env metadata: %m\n%s\n", progname, WITH_MOUNTPOINT "/.env");
-    for (std::list<char*>::const_iterator it = env_args.begin(), end = env_args.end(); it != end; ++it)
-        fprintf(fd, "%s\n", *it);
-    fclose(fd);
-
     // drop setuid
-    int uid = getuid(), gid = getgid();
-    CHECK(setresuid(uid, uid, uid) >= 0 && setresgid(gid, gid, gid) >= 0,
-        "%s: setresuid/setresgid failed: %m\n", progname);
-
-    // now that we've dropped privileges, install the environment
-    // that was passed on the commandline.
-    clearenv();
-    for (std::list<char*>::const_iterator it = env_args.begin(), end = env_args.end(); it != end; ++it)
-    {
-        char* env_var = *it;
-        assert(env_var);
-        putenv(env_var);
-    }
-
-    // we need to copy exec_args to a vector so it's laid out like an array
-    std::vector<char*> exec_args_as_array(exec_args.begin(), exec_args.end());
-    CHECK(execvp(exec_args_as_array[0], &exec_args_as_array[0]) != -1, "%s: cannot exec %s: %m\n", progname, exec_args_as_array[0]);
-    return 1;
+    return drop_privileges_and_exec(progname, getuid(), getgid(), env_args, exec_args);
 }
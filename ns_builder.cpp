@@ -0,0 +1,166 @@
+#include <sys/stat.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "ns_builder.hpp"
+
+#define CHECK(cond, args...) \
+    do { \
+        if(!(cond)) { \
+            fprintf(stderr, args); \
+            return 1; \
+        } \
+    } while(0)
+
+// compares targets (the part before the '=') with '/' sorting before every
+// other character, so a directory's contents end up next to each other
+static inline int target_char(const char *p)
+{
+    if (*p == '=' || *p == '\0')
+        return -1;
+    return *p == '/' ? 0 : (unsigned char)*p;
+}
+
+static bool target_less(const char *a, const char *b)
+{
+    for (;; ++a, ++b)
+    {
+        int ca = target_char(a), cb = target_char(b);
+        if (ca != cb)
+            return ca < cb;
+        if (ca < 0)
+            return false;
+    }
+}
+
+struct component
+{
+    const char *m_name;
+    size_t m_len;
+
+    bool operator==(const component &other) const
+        { return m_len == other.m_len && memcmp(m_name, other.m_name, m_len) == 0; }
+};
+
+// the directories we have open, from the root down
+struct dir_stack
+{
+    struct level
+    {
+        component m_name;
+        int m_fd;
+    };
+
+    dir_stack(int root_fd, ns_build_stats &stats) : m_root_fd(root_fd), m_stats(stats) {}
+    ~dir_stack() { pop_to(0); }
+
+    int top() const { return m_levels.empty() ? m_root_fd : m_levels.back().m_fd; }
+
+    void pop_to(size_t depth)
+    {
+        while (m_levels.size() > depth)
+        {
+            close(m_levels.back().m_fd);
+            ++m_stats.m_syscalls;
+            m_levels.pop_back();
+        }
+    }
+
+    int m_root_fd;
+    ns_build_stats &m_stats;
+    std::vector<level> m_levels;
+};
+
+// splits the target of target=src into its path components. Returns false
+// if there's a ".." in it.
+static bool split_target(const char *target, std::vector<component> &components)
+{
+    components.clear();
+    const char *p = target;
+    while (*p != '=' && *p != '\0')
+    {
+        const char *start = p;
+        while (*p != '/' && *p != '=' && *p != '\0')
+            ++p;
+        component c = { start, size_t(p - start) };
+        if (c.m_len == 2 && start[0] == '.' && start[1] == '.')
+            return false;
+        if (c.m_len != 0 && !(c.m_len == 1 && start[0] == '.'))
+            components.push_back(c);
+        if (*p == '/')
+            ++p;
+    }
+    return true;
+}
+
+int build_tree(const char *progname, int root_fd, std::vector<char *> targets, ns_build_stats &stats)
+{
+    std::sort(targets.begin(), targets.end(), target_less);
+
+    dir_stack dirs(root_fd, stats);
+    std::vector<component> components;
+    char name[NAME_MAX + 1];
+
+    for (std::vector<char *>::const_iterator it = targets.begin(), end = targets.end(); it != end; ++it)
+    {
+        const char *target = *it, *equal = strchr(target, '=');
+        int target_len = equal ? int(equal - target) : int(strlen(target));
+        CHECK(equal && equal[1], "%s argument %s is must be of the form target=src\n", progname, target);
+        CHECK(split_target(target, components) && !components.empty(),
+            "%s: target %.*s must name something below the mountpoint\n", progname, target_len, target);
+        for (std::vector<component>::const_iterator c = components.begin(), cend = components.end(); c != cend; ++c)
+            CHECK(c->m_len <= NAME_MAX, "%s: target %.*s: %s\n", progname, target_len, target, strerror(ENAMETOOLONG));
+
+        // keep the directories we share with the previous target open
+        size_t parents = components.size() - 1, depth = 0;
+        while (depth < dirs.m_levels.size() && depth < parents && dirs.m_levels[depth].m_name == components[depth])
+            ++depth;
+        dirs.pop_to(depth);
+
+        unsigned long created = 0;
+        for (; depth < parents; ++depth)
+        {
+            const component &c = components[depth];
+            memcpy(name, c.m_name, c.m_len);
+            name[c.m_len] = '\0';
+
+            stats.m_syscalls += 2;
+            stats.m_lookups += 2;
+            if (mkdirat(dirs.top(), name, 0755) == 0)
+                ++created;
+            else
+                CHECK(errno == EEXIST, "%s: create %.*s failed: %m\n", progname, int(c.m_name + c.m_len - target), target);
+
+            dir_stack::level level = { c, openat(dirs.top(), name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) };
+            CHECK(level.m_fd >= 0, "%s: open %.*s failed: %m\n", progname, int(c.m_name + c.m_len - target), target);
+            dirs.m_levels.push_back(level);
+        }
+
+        const component &leaf = components.back();
+        memcpy(name, leaf.m_name, leaf.m_len);
+        name[leaf.m_len] = '\0';
+        ++stats.m_syscalls;
+        ++stats.m_lookups;
+        CHECK(symlinkat(equal + 1, dirs.top(), name) == 0,
+            "%s: symlink %.*s -> %s failed: %m\n", progname, target_len, target, equal + 1);
+
+        // mkdir_p() costs one mkdir of the parent if it exists, and two per
+        // level (one failing with ENOENT, one succeeding) save the topmost
+        // if it doesn't; then one more for the symlink. Each of those walks
+        // the whole path from the root.
+        stats.m_path_syscalls += (created ? 2 * created - 1 : 1) + 1;
+        stats.m_path_lookups += components.size();
+        for (size_t level = parents; level + created > parents; --level)
+            stats.m_path_lookups += level == parents - created + 1 ? level : 2 * level;
+        if (!created)
+            stats.m_path_lookups += parents;
+        stats.m_dirs += created;
+        ++stats.m_entries;
+    }
+    return 0;
+}
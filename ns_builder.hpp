@@ -0,0 +1,32 @@
+#ifndef WITH_NS_BUILDER_H
+#define WITH_NS_BUILDER_H
+
+#include <vector>
+
+/// Syscall counts for one build_tree() call
+struct ns_build_stats
+{
+    ns_build_stats() : m_entries(0), m_dirs(0), m_syscalls(0), m_lookups(0), m_path_syscalls(0), m_path_lookups(0) {}
+
+    unsigned long m_entries, m_dirs;
+    // what build_tree issued, and how many path components the kernel had
+    // to resolve for them (not counting the root)
+    unsigned long m_syscalls, m_lookups;
+    // the same for mkdir_p()+symlink() on paths from the root
+    unsigned long m_path_syscalls, m_path_lookups;
+};
+
+/// Creates a symlink for each target=src in targets under the directory
+/// root_fd, along with any directories leading up to it.
+///
+/// The targets are sorted so that everything under a directory is
+/// contiguous, which turns the sorted list into a depth-first walk of the
+/// directory trie. Each directory is created and opened once, and its
+/// children are made with mkdirat/symlinkat relative to that fd, so no path
+/// gets resolved from the root again. Empty and "." components are skipped;
+/// ".." is refused, as is a target that is both a link and a directory.
+///
+/// Returns 0 on success, or 1 after printing an error to stderr.
+int build_tree(const char *progname, int root_fd, std::vector<char *> targets, ns_build_stats &stats);
+
+#endif // WITH_NS_BUILDER_H
@@ -0,0 +1,194 @@
+#ifndef WITH_NS_INDEX_H
+#define WITH_NS_INDEX_H
+
+// The binary namespace index the helper writes to WITH_MOUNTPOINT/.index,
+// next to the .ns and .env text files. It holds the same information in a
+// form that can be mapped and used in place, so looking at a namespace
+// doesn't take a stat and readlink of every entry.
+//
+// Layout, all integers in host byte order:
+//   ns_index_header
+//   ns_index_target[m_num_targets], sorted by target
+//   u32[m_num_env], the environment
+//   the string pool: NUL terminated strings, which everything above refers
+//   to by their offset from the start of the file
+//
+// m_checksum is FNV-1a over everything after the header. The file is
+// written to a temporary name and renamed into place, so readers either see
+// a whole index or none.
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define WITH_INDEX_MAGIC 0x57494e31 // "WIN1"
+#define WITH_INDEX_VERSION 1
+
+struct ns_index_header
+{
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint32_t m_length;      // of the whole file
+    uint32_t m_checksum;
+    uint32_t m_devname;     // the mount name
+    uint32_t m_num_targets;
+    uint32_t m_num_env;
+};
+
+struct ns_index_target
+{
+    uint32_t m_target;      // the path below WITH_MOUNTPOINT
+    uint32_t m_source;      // what it points at
+};
+
+inline uint32_t ns_index_checksum(const char *p, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h;
+}
+
+struct ns_index_writer
+{
+    ns_index_writer(const char *devname) : m_devname(devname) {}
+
+    // target=source, as passed to the helper
+    void add_target(const char *target_source)
+    {
+        const char *equal = strchr(target_source, '=');
+        if (!equal)
+            return;
+        m_targets.push_back(std::make_pair(std::string(target_source, equal), std::string(equal + 1)));
+    }
+
+    void add_env(const char *var) { m_env.push_back(var); }
+
+    // returns the finished index
+    std::string finish()
+    {
+        std::sort(m_targets.begin(), m_targets.end());
+
+        std::vector<ns_index_target> targets(m_targets.size());
+        std::vector<uint32_t> env(m_env.size());
+        std::string pool;
+        size_t pool_start = sizeof(ns_index_header) + targets.size() * sizeof(ns_index_target)
+            + env.size() * sizeof(uint32_t);
+
+        ns_index_header header;
+        header.m_magic = WITH_INDEX_MAGIC;
+        header.m_version = WITH_INDEX_VERSION;
+        header.m_devname = add_string(pool, pool_start, m_devname);
+        header.m_num_targets = targets.size();
+        header.m_num_env = env.size();
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            targets[i].m_target = add_string(pool, pool_start, m_targets[i].first);
+            targets[i].m_source = add_string(pool, pool_start, m_targets[i].second);
+        }
+        for (size_t i = 0; i < env.size(); ++i)
+            env[i] = add_string(pool, pool_start, m_env[i]);
+
+        std::string buf;
+        buf.reserve(pool_start + pool.size());
+        buf.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        if (!targets.empty())
+            buf.append(reinterpret_cast<const char *>(&targets[0]), targets.size() * sizeof(ns_index_target));
+        if (!env.empty())
+            buf.append(reinterpret_cast<const char *>(&env[0]), env.size() * sizeof(uint32_t));
+        buf.append(pool);
+
+        header.m_length = buf.size();
+        header.m_checksum = ns_index_checksum(buf.data() + sizeof(header), buf.size() - sizeof(header));
+        buf.replace(0, sizeof(header), reinterpret_cast<const char *>(&header), sizeof(header));
+        return buf;
+    }
+
+private:
+    static uint32_t add_string(std::string &pool, size_t pool_start, const std::string &s)
+    {
+        uint32_t off = pool_start + pool.size();
+        pool.append(s.c_str(), s.size() + 1);
+        return off;
+    }
+
+    std::string m_devname;
+    std::vector<std::pair<std::string, std::string> > m_targets;
+    std::vector<std::string> m_env;
+};
+
+/// Checks an index built by ns_index_writer and hands out pointers into it.
+/// The buffer (usually a mapping of the file) must outlive the reader.
+struct ns_index_reader
+{
+    ns_index_reader() : m_buf(NULL) {}
+
+    // returns false if the index is malformed, or from a different version
+    bool parse(const char *buf, size_t len)
+    {
+        m_buf = NULL;
+        if (len < sizeof(ns_index_header))
+            return false;
+        memcpy(&m_header, buf, sizeof(m_header));
+        if (m_header.m_magic != WITH_INDEX_MAGIC || m_header.m_version != WITH_INDEX_VERSION
+            || m_header.m_length != len || buf[len - 1] != '\0'
+            || m_header.m_checksum != ns_index_checksum(buf + sizeof(m_header), len - sizeof(m_header)))
+            return false;
+
+        // the tables have to fit, and every offset has to land in the pool
+        uint64_t pool_start = sizeof(ns_index_header) + uint64_t(m_header.m_num_targets) * sizeof(ns_index_target)
+            + uint64_t(m_header.m_num_env) * sizeof(uint32_t);
+        if (pool_start >= len || !in_pool(m_header.m_devname, pool_start, len))
+            return false;
+        const char *p = buf + sizeof(ns_index_header);
+        for (uint32_t i = 0; i < m_header.m_num_targets; ++i, p += sizeof(ns_index_target))
+        {
+            ns_index_target t;
+            memcpy(&t, p, sizeof(t));
+            if (!in_pool(t.m_target, pool_start, len) || !in_pool(t.m_source, pool_start, len))
+                return false;
+        }
+        for (uint32_t i = 0; i < m_header.m_num_env; ++i, p += sizeof(uint32_t))
+        {
+            uint32_t off;
+            memcpy(&off, p, sizeof(off));
+            if (!in_pool(off, pool_start, len))
+                return false;
+        }
+
+        m_buf = buf;
+        return true;
+    }
+
+    const char *devname() const { return m_buf + m_header.m_devname; }
+
+    uint32_t num_targets() const { return m_header.m_num_targets; }
+    const char *target(uint32_t i) const { return m_buf + get_target(i).m_target; }
+    const char *source(uint32_t i) const { return m_buf + get_target(i).m_source; }
+
+    uint32_t num_env() const { return m_header.m_num_env; }
+    const char *env(uint32_t i) const
+    {
+        uint32_t off;
+        memcpy(&off, m_buf + sizeof(ns_index_header) + m_header.m_num_targets * sizeof(ns_index_target)
+            + i * sizeof(uint32_t), sizeof(off));
+        return m_buf + off;
+    }
+
+private:
+    static bool in_pool(uint32_t off, uint64_t pool_start, size_t len) { return off >= pool_start && off < len; }
+
+    ns_index_target get_target(uint32_t i) const
+    {
+        ns_index_target t;
+        memcpy(&t, m_buf + sizeof(ns_index_header) + i * sizeof(ns_index_target), sizeof(t));
+        return t;
+    }
+
+    const char *m_buf;
+    ns_index_header m_header;
+};
+
+#endif // WITH_NS_INDEX_H
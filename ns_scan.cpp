@@ -0,0 +1,178 @@
+#include "ns_scan.hpp"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <map>
+
+#include "exec.hpp"
+#include "exec_defs.hpp"
+#include "pipe.hpp"
+
+#define CHECK(cond, fmt...) \
+    do { \
+        if(!(cond)) \
+            throw failure(fmt); \
+    } while(0)
+
+typedef std::map<ino_t, std::vector<pid_t> > NamespaceMap;
+
+// lists the numeric entries of /proc, a getdents64 bufferful at a time
+static void readPids(int procFD, std::vector<pid_t> &pids)
+{
+    std::vector<char> buf(65536);
+    for(;;)
+    {
+        long len = syscall(SYS_getdents64, procFD, &buf[0], buf.size());
+        CHECK(len >= 0 || errno == EINTR, "getdents /proc failed: %m");
+        if(len == 0)
+            break;
+        if(len < 0)
+            continue;
+        for(long off = 0; off < len; )
+        {
+            const struct dirent64 *d = reinterpret_cast<const struct dirent64 *>(&buf[off]);
+            off += d->d_reclen;
+            char *end;
+            long pid = strtol(d->d_name, &end, 10);
+            if(d->d_name[0] >= '1' && d->d_name[0] <= '9' && *end == '\0')
+                pids.push_back(pid);
+        }
+    }
+    std::sort(pids.begin(), pids.end());
+}
+
+// the pids [m_begin, m_end) grouped by the inode of their mount namespace.
+// Processes which went away or which we can't look at are skipped.
+struct ScanRange
+{
+    int m_procFD;
+    const pid_t *m_begin, *m_end;
+    NamespaceMap m_namespaces;
+
+    void run()
+    {
+        char path[64];
+        struct stat st;
+        for(const pid_t *pid = m_begin; pid != m_end; ++pid)
+        {
+            snprintf(path, sizeof(path), "%d/ns/mnt", int(*pid));
+            if(fstatat(m_procFD, path, &st, 0) == 0)
+                m_namespaces[st.st_ino].push_back(*pid);
+        }
+    }
+
+    static void *thread(void *arg)
+    {
+        static_cast<ScanRange *>(arg)->run();
+        return NULL;
+    }
+};
+
+static bool byFirstPid(const with_namespace_info &a, const with_namespace_info &b)
+{
+    return a.m_pids.front() < b.m_pids.front();
+}
+
+// fills in everything but m_ino and m_pids through the /with of the first
+// of pids which is still around. Returns false if none is.
+static bool readNamespace(int procFD, with_namespace_info &info)
+{
+    for(std::vector<pid_t>::const_iterator pid = info.m_pids.begin(), end = info.m_pids.end(); pid != end; ++pid)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "%d/root" WITH_MOUNTPOINT, int(*pid));
+        FD with(openat(procFD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if(!with.isOk())
+            continue;
+
+        // an overlay reports the statfs of its upper layer, the namespace's
+        // own tmpfs, rather than of the shared tree under it
+        struct statfs fs;
+        bool ok = fstatfs(with.get(), &fs) == 0;
+        info.m_used = ok ? (unsigned long long)(fs.f_blocks - fs.f_bfree) * fs.f_bsize : 0;
+        info.m_cached = ok && fs.f_type == OVERLAYFS_SUPER_MAGIC;
+
+        // .ns starts with the mount name
+        FD ns(openat(with.get(), ".ns", O_RDONLY | O_CLOEXEC));
+        char buf[256];
+        ssize_t len = ns.isOk() ? read(ns.get(), buf, sizeof(buf) - 1) : -1;
+        if(len > 0)
+        {
+            buf[len] = '\0';
+            info.m_devname.assign(buf, strcspn(buf, " \n"));
+            if(info.m_devname == "--init.d")
+                info.m_devname = "global";
+        }
+        return true;
+    }
+    return false;
+}
+
+void scan_with_namespaces(int threads, std::vector<with_namespace_info> &namespaces)
+{
+    FD procFD(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    CHECK(procFD.isOk(), "open /proc failed: %m");
+    std::vector<pid_t> pids;
+    readPids(procFD.get(), pids);
+
+    // split the pids into contiguous ranges, one per thread
+    size_t count = std::max(1, std::min(threads, int(pids.size())));
+    std::vector<ScanRange> ranges(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        ranges[i].m_procFD = procFD.get();
+        ranges[i].m_begin = pids.empty() ? NULL : &pids[0] + pids.size() * i / count;
+        ranges[i].m_end = pids.empty() ? NULL : &pids[0] + pids.size() * (i + 1) / count;
+    }
+
+    // the first range is ours; if a thread can't be started, we do its range too
+    std::vector<pthread_t> tids(count);
+    std::vector<bool> started(count, false);
+    for(size_t i = 1; i < count; ++i)
+        started[i] = pthread_create(&tids[i], NULL, &ScanRange::thread, &ranges[i]) == 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(i == 0 || !started[i])
+            ranges[i].run();
+    }
+    for(size_t i = 1; i < count; ++i)
+    {
+        if(started[i])
+            pthread_join(tids[i], NULL);
+    }
+
+    // the ranges are in pid order, so appending keeps each namespace's pids sorted
+    NamespaceMap merged;
+    for(std::vector<ScanRange>::const_iterator r = ranges.begin(), rend = ranges.end(); r != rend; ++r)
+    {
+        for(NamespaceMap::const_iterator ns = r->m_namespaces.begin(), end = r->m_namespaces.end(); ns != end; ++ns)
+        {
+            std::vector<pid_t> &nsPids = merged[ns->first];
+            nsPids.insert(nsPids.end(), ns->second.begin(), ns->second.end());
+        }
+    }
+
+    namespaces.clear();
+    for(NamespaceMap::iterator ns = merged.begin(), end = merged.end(); ns != end; ++ns)
+    {
+        with_namespace_info info;
+        info.m_ino = ns->first;
+        info.m_used = 0;
+        info.m_cached = false;
+        info.m_pids.swap(ns->second);
+        if(readNamespace(procFD.get(), info))
+            namespaces.push_back(info);
+    }
+    std::sort(namespaces.begin(), namespaces.end(), byFirstPid);
+}
@@ -0,0 +1,29 @@
+#ifndef WITH_NS_SCAN_H
+#define WITH_NS_SCAN_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/// One mount namespace with a /with, and the processes in it
+struct with_namespace_info
+{
+    ino_t m_ino;                // of /proc/<pid>/ns/mnt
+    std::string m_devname;      // the mount name, from /with/.ns; "global"
+                                // for the one the init script made
+    unsigned long long m_used;  // bytes in use on the tmpfs at /with
+    bool m_cached;              // /with is an overlay on a cached tree, so
+                                // m_used only counts what was added on top
+    std::vector<pid_t> m_pids;  // sorted
+};
+
+/// Finds every process we can see whose /with is reachable, grouped by
+/// mount namespace, sorted by their lowest pid.
+///
+/// Each process costs one fstatat of its ns/mnt link relative to an fd for
+/// /proc; the /with of each distinct namespace is then only looked at once.
+/// With threads > 1 the pids are split into that many ranges, each statted
+/// by its own thread.
+void scan_with_namespaces(int threads, std::vector<with_namespace_info> &namespaces);
+
+#endif // WITH_NS_SCAN_H
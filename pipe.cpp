@@ -1,12 +1,21 @@
 #include "pipe.hpp"
+#include "cgroup.hpp"
+#include "pump.hpp"
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/file.h>
+#include <boost/scoped_ptr.hpp>
 
 #define CHECK(cond, fmt...) \
     do { \
@@ -73,6 +82,20 @@ void FD::setNonBlock()
         "fcntl(F_SETFL) failed: %m");
 }
 
+int pipeMaxSize()
+{
+    static int maxSize = 0;
+    if(maxSize == 0)
+    {
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+        if(!f || fscanf(f, "%d", &maxSize) != 1 || maxSize <= 0)
+            maxSize = 1024 * 1024; // the default since linux 2.6.35
+        if(f)
+            fclose(f);
+    }
+    return maxSize;
+}
+
 void daemon_pipe::File::open()
 {
     if(m_spec->m_filename.empty())
@@ -80,6 +103,11 @@ void daemon_pipe::File::open()
         m_readSide.reset(new FD);
         m_writeSide.reset(new FD);
         FD::pipe(*m_readSide, *m_writeSide, FD_CLOEXEC);
+        // a user over their pipe-user-pages-soft limit can't grow pipes; they
+        // just work with the default size
+        if(m_spec->m_pipeSize > 0)
+            fcntl(m_writeSide->get(), F_SETPIPE_SZ, std::min(m_spec->m_pipeSize, pipeMaxSize()));
+        m_spec->m_actualPipeSize = fcntl(m_writeSide->get(), F_GETPIPE_SZ);
     }
     else
     {
@@ -128,7 +156,46 @@ void daemon_pipe::File::open()
     }
 }
 
-// fork+exec, propagates errors in the child back to the parent via a pipe
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+// struct clone_args as far as cgroup, which older kernel headers don't have
+struct CloneArgs
+{
+    uint64_t m_flags, m_pidfd, m_childTID, m_parentTID, m_exitSignal, m_stack, m_stackSize, m_tls,
+             m_setTID, m_setTIDSize, m_cgroup;
+};
+
+// fork(), with the child starting out in the cgroup cgroupFD if that's not
+// -1. Kernels before 5.7 can't do that, and then joinCgroup is set to tell
+// the child to move itself before it does anything else.
+static int forkInto(int cgroupFD, bool &joinCgroup)
+{
+    joinCgroup = false;
+    if(cgroupFD < 0)
+        return fork();
+
+    CloneArgs args;
+    memset(&args, 0, sizeof(args));
+    args.m_flags = CLONE_INTO_CGROUP;
+    args.m_exitSignal = SIGCHLD;
+    args.m_cgroup = cgroupFD;
+    int pid = syscall(SYS_clone3, &args, sizeof(args));
+    if(pid < 0 && (errno == ENOSYS || errno == E2BIG || errno == EINVAL))
+    {
+        joinCgroup = true;
+        pid = fork();
+    }
+    return pid;
+}
+
+// fork+exec. Errors in the child are written to a pipe which is left in
+// m_execErrors, so that the parent can start the rest of the pipeline before
+// it reads them.
 int daemon_pipe::Proc::safe_fork_exec()
 {
     int pid = -1;
@@ -138,53 +205,143 @@ int daemon_pipe::Proc::safe_fork_exec()
     FD::pipe(errorPipeRead, errorPipeWrite, FD_CLOEXEC);
     errorPipeWrite.setNonBlock();
 
-    pid = fork();
+    bool joinCgroup;
+    pid = forkInto(m_cgroupFD, joinCgroup);
     CHECK(pid >= 0, "fork failed: %m");
 
-    try
+    if(pid == 0)
     {
-        if(pid == 0)
+        try
         {
-            try
-            {
-                if(m_newPGID >= 0)
-                    CHECK(setpgid(0, m_newPGID) == 0, "setpgid failed: %m");
-                if(m_stdin)
-                    CHECK(dup2(m_stdin->m_readSide->get(), STDIN_FILENO) >= 0, "dup2 failed: %m");
-                if(m_stdout)
-                    CHECK(dup2(m_stdout->m_writeSide->get(), STDOUT_FILENO) >= 0, "dup2 failed: %m");
-                if(m_stderr)
-                    CHECK(dup2(m_stderr->m_writeSide->get(), STDERR_FILENO) >= 0, "dup2 failed: %m");
-                if(m_blockedSignals)
-                    m_blockedSignals->unblock();
-
-                m_spec->m_cmdArgv.do_execvp();
-            }
-            catch(failure &e)
+            if(joinCgroup)
             {
-                int ret = write(errorPipeWrite.get(), e.what(), strlen(e.what()));
-                (void)ret;
+                FD procs(openat(m_cgroupFD, "cgroup.procs", O_WRONLY | O_CLOEXEC));
+                CHECK(procs.isOk() && write(procs.get(), "0", 1) == 1, "joining cgroup failed: %m");
             }
-            _exit(1);
+            if(m_newPGID >= 0)
+                CHECK(setpgid(0, m_newPGID) == 0, "setpgid failed: %m");
+            if(m_stdin)
+                CHECK(dup2(m_stdin->m_readSide->get(), STDIN_FILENO) >= 0, "dup2 failed: %m");
+            if(m_stdout)
+                CHECK(dup2(m_stdout->m_writeSide->get(), STDOUT_FILENO) >= 0, "dup2 failed: %m");
+            if(m_stderr)
+                CHECK(dup2(m_stderr->m_writeSide->get(), STDERR_FILENO) >= 0, "dup2 failed: %m");
+            if(m_blockedSignals)
+                m_blockedSignals->unblock();
+
+            m_spec->m_cmdArgv.do_execvp();
+        }
+        catch(failure &e)
+        {
+            int ret = write(errorPipeWrite.get(), e.what(), strlen(e.what()));
+            (void)ret;
         }
-        errorPipeWrite.reset();
-        failure f;
-        ssize_t ret = read(errorPipeRead.get(), f.m_err, sizeof(f.m_err));
-        CHECK(ret >= 0, "read from error pipe failed: %m");
-        if(ret > 0)
-            throw f;
+        _exit(1);
+    }
 
-        m_spec->m_pid = pid;
-        return pid;
+    // the child may not have made its process group yet, and the next one
+    // we start may want to join it. Once it has exec'd this fails, which is
+    // fine since then it has made it.
+    if(m_newPGID >= 0)
+        setpgid(pid, m_newPGID);
+    m_execErrors.move_from(errorPipeRead);
+    m_spec->m_pid = pid;
+    return pid;
+}
+
+/// RAII holder for the posix_spawn attribute and file action objects
+struct SpawnPlan : public boost::noncopyable
+{
+    SpawnPlan()
+    {
+        CHECK(posix_spawnattr_init(&m_attr) == 0, "posix_spawnattr_init failed");
+        if(posix_spawn_file_actions_init(&m_actions) != 0)
+        {
+            posix_spawnattr_destroy(&m_attr);
+            throw failure("posix_spawn_file_actions_init failed");
+        }
     }
-    catch(...)
+    ~SpawnPlan()
     {
-        kill(pid, SIGTERM);
-        waitpid(pid, NULL, 0);
-        throw;
+        posix_spawn_file_actions_destroy(&m_actions);
+        posix_spawnattr_destroy(&m_attr);
+    }
+
+    void dup2(int fd, int newfd)
+    {
+        CHECK(posix_spawn_file_actions_adddup2(&m_actions, fd, newfd) == 0,
+            "posix_spawn_file_actions_adddup2 failed");
+    }
+
+    posix_spawnattr_t m_attr;
+    posix_spawn_file_actions_t m_actions;
+};
+
+// Same contract as safe_fork_exec, built on posix_spawn. The pgid, the dup2
+// plan and the signal mask are all handed to glibc up front, which runs them
+// in a CLONE_VM|CLONE_VFORK child. That means no page table copy of our
+// (possibly very large) address space, and no allocation in the child.
+// Any failure in the child comes back as the return value of posix_spawnp.
+// The price is that posix_spawnp waits for each child to exec, so unlike
+// with safe_fork_exec the stages of a pipeline start one at a time.
+int daemon_pipe::Proc::safe_spawn()
+{
+    CHECK(!m_spec->m_cmdArgv.empty(), "cmd_argv is empty");
+
+    SpawnPlan plan;
+    short flags = 0;
+#ifdef POSIX_SPAWN_USEVFORK // implied by glibc >= 2.24, needed before that
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    if(m_cgroupFD >= 0)
+    {
+#ifdef POSIX_SPAWN_SETCGROUP // glibc 2.39
+        flags |= POSIX_SPAWN_SETCGROUP;
+        CHECK(posix_spawnattr_setcgroup_np(&plan.m_attr, m_cgroupFD) == 0, "posix_spawnattr_setcgroup_np failed");
+#else
+        // only clone3 can start a child in a cgroup
+        return safe_fork_exec();
+#endif
+    }
+    if(m_newPGID >= 0)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        CHECK(posix_spawnattr_setpgroup(&plan.m_attr, m_newPGID) == 0, "posix_spawnattr_setpgroup failed");
+    }
+    if(m_stdin)
+        plan.dup2(m_stdin->m_readSide->get(), STDIN_FILENO);
+    if(m_stdout)
+        plan.dup2(m_stdout->m_writeSide->get(), STDOUT_FILENO);
+    if(m_stderr)
+        plan.dup2(m_stderr->m_writeSide->get(), STDERR_FILENO);
+    if(m_blockedSignals)
+    {
+        flags |= POSIX_SPAWN_SETSIGMASK;
+        CHECK(posix_spawnattr_setsigmask(&plan.m_attr, &m_blockedSignals->m_oldset) == 0,
+            "posix_spawnattr_setsigmask failed");
     }
+    CHECK(posix_spawnattr_setflags(&plan.m_attr, flags) == 0, "posix_spawnattr_setflags failed");
+
+    const exec_args &argv = m_spec->m_cmdArgv;
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv.exec_name(), &plan.m_actions, &plan.m_attr,
+        &argv.m_args.front(), environ);
+    if(err != 0)
+    {
+        // posix_spawnp has already reaped the child
+        errno = err;
+        throw failure("posix_spawn %s failed: %m", argv.exec_name());
+    }
+
+    m_spec->m_pid = pid;
+    return pid;
 }
 
+// shared by all the SignalBlockers that exist at once
+static int signalBlockers = 0;
+static sigset_t blockersOldset;
+static struct sigaction blockersOldHUPAction;
+
 SignalBlocker::SignalBlocker()
 {
     CHECK(sigemptyset(&m_sigset) == 0, "sigemptyset failed: %m");
@@ -195,19 +352,27 @@ SignalBlocker::SignalBlocker()
     CHECK(sigaddset(&m_sigset, SIGQUIT) == 0, "sigaddset failed: %m");
     CHECK(sigaddset(&m_sigset, SIGPIPE) == 0, "sigaddset failed: %m");
 
-    /// ignore SIGHUP and leave it ignored for our children.
-    struct sigaction action = {};
-    action.sa_handler = SIG_IGN;
-    CHECK(sigaction(SIGHUP, &action, &m_oldHUPAction) == 0, "sigaction failed: %m");
+    if(signalBlockers == 0)
+    {
+        /// ignore SIGHUP and leave it ignored for our children.
+        struct sigaction action = {};
+        action.sa_handler = SIG_IGN;
+        CHECK(sigaction(SIGHUP, &action, &blockersOldHUPAction) == 0, "sigaction failed: %m");
 
-    CHECK(sigprocmask(SIG_BLOCK, &m_sigset, &m_oldset) == 0, "sigprocmask failed: %m");
+        CHECK(sigprocmask(SIG_BLOCK, &m_sigset, &blockersOldset) == 0, "sigprocmask failed: %m");
+    }
+    ++signalBlockers;
+    m_oldset = blockersOldset;
 }
 
 SignalBlocker::~SignalBlocker()
 {
+    if(--signalBlockers > 0)
+        return;
+
     unblock();
 
-    if(sigaction(SIGHUP, &m_oldHUPAction, NULL) == -1 && !std::uncaught_exception())
+    if(sigaction(SIGHUP, &blockersOldHUPAction, NULL) == -1 && !std::uncaught_exception())
         throw failure("sigaction failed: %m");
 }
 
@@ -219,91 +384,551 @@ void SignalBlocker::unblock()
 }
 
 
+#ifndef SYS_pidfd_open // linux 5.3
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#define WAITID_P_PIDFD 3 // linux 5.4; not in older glibc's idtype_t
+
+/// Reaps our children and forwards signals to them from one epoll loop:
+/// each child gets a pidfd, which becomes readable when it exits, and the
+/// signals SignalBlocker blocks are read from a signalfd. An exit costs one
+/// waitid on the pidfd that fired instead of a waitpid on every child (or,
+/// on linux 5.3, which can't wait on a pidfd, a wait4 on its pid).
+///
+/// On kernels without pidfds, children fall back to being polled with
+/// waitpid(WNOHANG) whenever a SIGCHLD arrives.
+///
+/// If there are pumps, the loop runs them too, and keeps going until they
+/// have finished as well as the children.
 struct ProcHarvester
 {
-    ProcHarvester(sigset_t *sigset)
-        : m_sigset(sigset) {}
+    ProcHarvester(sigset_t *sigset, PumpSet *pumps = NULL)
+        : m_sigset(sigset)
+        , m_pgid(0)
+        , m_cgroup(NULL)
+        , m_pumps(pumps)
+        , m_running(0)
+        , m_pendingRestarts(0)
+        , m_stopping(false)
+    {
+        m_epoll.reset(epoll_create1(EPOLL_CLOEXEC));
+        CHECK(m_epoll.isOk(), "epoll_create1 failed: %m");
+        m_signals.reset(signalfd(-1, sigset, SFD_CLOEXEC | SFD_NONBLOCK));
+        CHECK(m_signals.isOk(), "signalfd failed: %m");
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; // NULL means the signalfd
+        CHECK(epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, m_signals.get(), &ev) == 0,
+            "epoll_ctl failed: %m");
+        if(m_pumps)
+        {
+            ev.data.ptr = m_pumps;
+            CHECK(epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, m_pumps->fd(), &ev) == 0,
+                "epoll_ctl failed: %m");
+        }
+        m_restartTimer.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+        CHECK(m_restartTimer.isOk(), "timerfd_create failed: %m");
+        ev.data.ptr = &m_restartTimer;
+        CHECK(epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, m_restartTimer.get(), &ev) == 0,
+            "epoll_ctl failed: %m");
+        s_harvesters.push_back(this);
+    }
     ~ProcHarvester()
     {
+        // nothing gets restarted while we wait for what's left
+        stop();
         try {
             harvest();
         }
         catch(...) {}
         m_procs.clear();
+        s_harvesters.erase(std::find(s_harvesters.begin(), s_harvesters.end(), this));
     }
 
     daemon_pipe::Proc &addProc(const daemon_proc_spec_ptr &spec)
     {
         spec->resetStatus();
+        spec->m_restarts = 0;
+        spec->m_crashLooping = false;
         daemon_pipe::ProcPtr proc(new daemon_pipe::Proc(spec));
         m_procs.push_back(proc);
         return *m_procs.back();
     }
 
-    void harvest()
+    /// starts proc and adds it to the set of children we wait for
+    int start(daemon_pipe::Proc &proc)
     {
-        while(true)
+        int pid = proc.start();
+        ++m_running;
+        proc.m_startedAt = monotonicMS();
+        proc.m_startedAtSecs = now(CLOCK_MONOTONIC);
+        proc.m_spec->m_startTime = now(CLOCK_REALTIME);
+        if(proc.m_spec->m_forwardSignals
+                && std::find(m_forwarders.begin(), m_forwarders.end(), &proc) == m_forwarders.end())
+            m_forwarders.push_back(&proc);
+
+        // if we can't get a pidfd for any reason, the child is still ours
+        // to reap; it just gets polled on SIGCHLD.
+        proc.m_pidfd.reset(syscall(SYS_pidfd_open, pid, 0));
+        if(proc.m_pidfd.isOk())
         {
-            bool somethingleft = false;
-            // waitpid on each of our children and mark anything that's exited
-            std::vector<daemon_pipe::ProcPtr>::iterator i = m_procs.begin(), end = m_procs.end();
-            for(; i != end; ++i)
-            {
-                if(!(*i)->m_spec->running())
-                    continue;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = &proc;
+            if(epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, proc.m_pidfd.get(), &ev) != 0)
+                proc.m_pidfd.reset();
+        }
+        if(!proc.m_pidfd.isOk())
+            m_unwatched.push_back(&proc);
+        return pid;
+    }
 
-                int status;
-                int ret = waitpid((*i)->m_spec->m_pid, &status, WNOHANG);
-                CHECK(ret >= 0, "waitpid failed: %m");
+    /// waits for every child started with fork+exec to either exec or say
+    /// why it couldn't, all at once. Throws the first failure.
+    void confirmExecs()
+    {
+        std::vector<struct pollfd> fds;
+        std::vector<daemon_pipe::Proc *> procs;
+        for(std::vector<daemon_pipe::ProcPtr>::const_iterator i = m_procs.begin(), end = m_procs.end(); i != end; ++i)
+        {
+            if(!(*i)->m_execErrors.isOk())
+                continue;
+            struct pollfd pfd = {};
+            pfd.fd = (*i)->m_execErrors.get();
+            pfd.events = POLLIN;
+            fds.push_back(pfd);
+            procs.push_back(i->get());
+        }
 
-                if(ret > 0)
+        failure first;
+        bool failed = false;
+        while(!fds.empty())
+        {
+            int n = poll(&fds[0], fds.size(), -1);
+            if(n < 0 && errno == EINTR)
+                continue;
+            CHECK(n >= 0, "poll failed: %m");
+            for(size_t i = fds.size(); i-- > 0; )
+            {
+                if(!fds[i].revents)
+                    continue;
+                // EOF means the exec closed it
+                failure f;
+                ssize_t ret = read(fds[i].fd, f.m_err, sizeof(f.m_err) - 1);
+                if(ret > 0 && !failed)
                 {
-                    (*i)->m_spec->m_exited = true;
-                    (*i)->m_spec->m_status = status;
+                    f.m_err[ret] = '\0';
+                    first = f;
+                    failed = true;
                 }
-                else
-                    somethingleft = true;
+                procs[i]->m_execErrors.reset();
+                fds.erase(fds.begin() + i);
+                procs.erase(procs.begin() + i);
             }
+        }
+        if(failed)
+            throw first;
+    }
 
-            if(!somethingleft)
-                break;
+    /// sends sig to every child that's still running, without waiting for
+    /// any of them; harvest() then reaps them together
+    void terminate(int sig)
+    {
+        stop();
+        for(std::vector<daemon_pipe::ProcPtr>::const_iterator i = m_procs.begin(), end = m_procs.end(); i != end; ++i)
+        {
+            daemon_pipe::Proc &proc = **i;
+            if(!proc.m_spec->running())
+                continue;
+            if(proc.m_pidfd.isOk())
+                syscall(SYS_pidfd_send_signal, proc.m_pidfd.get(), sig, NULL, 0);
+            else
+                kill(proc.m_spec->m_pid, sig);
+        }
+    }
 
-            int sig;
-            CHECK(sigwait(m_sigset, &sig) == 0, "sigwait failed: %m");
+    /// true once every child has been reaped, and won't be restarted, and
+    /// every pump has finished
+    bool done() const { return m_running == 0 && m_pendingRestarts == 0 && !(m_pumps && m_pumps->active()); }
 
-            switch(sig)
+    /// closes our ends of file, unless a child which may yet be restarted
+    /// needs it. Otherwise its readers wouldn't see EOF, nor its writers EPIPE.
+    void release(daemon_pipe::File &file)
+    {
+        for(std::vector<daemon_pipe::ProcPtr>::const_iterator i = m_procs.begin(), end = m_procs.end(); i != end; ++i)
+        {
+            const daemon_pipe::Proc &proc = **i;
+            if(proc.restartable() && (proc.m_stdin == &file || proc.m_stdout == &file || proc.m_stderr == &file))
+                return;
+        }
+        file.close();
+    }
+
+    /// from now on, children which exit stay dead
+    void stop()
+    {
+        m_stopping = true;
+        for(std::vector<daemon_pipe::ProcPtr>::const_iterator i = m_procs.begin(), end = m_procs.end(); i != end; ++i)
+        {
+            if((*i)->m_restartAt)
             {
-            // forward these signals onto any of our children that have m_forwardSignals set.
-            case SIGTERM:
-            case SIGINT:
-            case SIGQUIT:
-                for(std::vector<daemon_pipe::ProcPtr>::iterator i = m_procs.begin(), end = m_procs.end();
-                      i != end; ++i)
+                (*i)->m_restartAt = 0;
+                --m_pendingRestarts;
+            }
+            if((*i)->restartable())
+                giveUp(**i);
+        }
+    }
+
+    /// waits up to timeoutMS (-1 for as long as it takes) for something to
+    /// happen, and handles whatever has
+    void step(int timeoutMS)
+    {
+        pollUnwatched();
+        if(done())
+            return;
+        struct epoll_event events[64];
+        int n = epoll_wait(m_epoll.get(), events, sizeof(events) / sizeof(events[0]), timeoutMS);
+        if(n < 0 && errno == EINTR)
+            return;
+        CHECK(n >= 0, "epoll_wait failed: %m");
+
+        for(int i = 0; i < n; ++i)
+        {
+            if(m_pumps && events[i].data.ptr == m_pumps)
+                m_pumps->run();
+            else if(events[i].data.ptr == &m_restartTimer)
+                restartDue();
+            else if(events[i].data.ptr)
+                reap(*static_cast<daemon_pipe::Proc *>(events[i].data.ptr));
+            else
+                readSignals();
+        }
+    }
+
+    void harvest()
+    {
+        while(!done())
+            step(-1);
+    }
+
+    /// readable whenever step() has something to do
+    int fd() const { return m_epoll.get(); }
+
+    std::vector<daemon_pipe::ProcPtr> m_procs;
+    const sigset_t *m_sigset;
+    int m_pgid; // of the pipeline, which restarted children rejoin
+    Cgroup *m_cgroup; // the pipeline's, if it has one
+
+private:
+    static int64_t monotonicMS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static double now(clockid_t clock)
+    {
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    void exited(daemon_pipe::Proc &proc, int status, const struct rusage &usage)
+    {
+        proc.m_spec->m_exited = true;
+        proc.m_spec->m_status = status;
+        proc.m_spec->m_endTime = now(CLOCK_REALTIME);
+        proc.m_spec->m_wallTime = now(CLOCK_MONOTONIC) - proc.m_startedAtSecs;
+        proc.m_spec->m_rusage = usage;
+        --m_running;
+        afterExit(proc);
+
+        // once the children are all gone for good, so is anything they
+        // left running, which might be holding our pumps' pipes open
+        if(m_running == 0 && m_pendingRestarts == 0 && m_cgroup)
+        {
+            try
+            {
+                m_cgroup->kill();
+            }
+            catch(failure &)
+            {
+            }
+        }
+    }
+
+    // restarts proc if its policy says so and it isn't crash looping. Until
+    // then it counts as running, and we keep its files open for it.
+    void afterExit(daemon_pipe::Proc &proc)
+    {
+        daemon_proc_spec &spec = *proc.m_spec;
+        int status = spec.m_status;
+        bool failed = !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        if(!proc.restartable())
+            return;
+        if(m_stopping || (spec.m_restart == daemon_proc_spec::RESTART_ON_FAILURE && !failed))
+        {
+            giveUp(proc);
+            return;
+        }
+
+        int64_t now = monotonicMS();
+        while(!proc.m_restartTimes.empty() && proc.m_restartTimes.front() <= now - 60000)
+            proc.m_restartTimes.pop_front();
+        if(spec.m_maxRestartsPerMin > 0 && int(proc.m_restartTimes.size()) >= spec.m_maxRestartsPerMin)
+        {
+            spec.m_crashLooping = true;
+            giveUp(proc);
+            return;
+        }
+
+        // the wait doubles each time, unless it stayed up for longer than
+        // the longest wait, when it starts again from the shortest
+        if(now - proc.m_startedAt >= spec.m_backoffMaxMS)
+            proc.m_backoffMS = 0;
+        proc.m_backoffMS = proc.m_backoffMS == 0 ? spec.m_backoffMinMS
+            : std::min(proc.m_backoffMS * 2, spec.m_backoffMaxMS);
+        proc.m_restartAt = now + std::max(proc.m_backoffMS, 1);
+        ++m_pendingRestarts;
+        armRestartTimer();
+    }
+
+    void armRestartTimer()
+    {
+        int64_t next = 0;
+        for(std::vector<daemon_pipe::ProcPtr>::const_iterator i = m_procs.begin(), end = m_procs.end(); i != end; ++i)
+        {
+            if((*i)->m_restartAt && (next == 0 || (*i)->m_restartAt < next))
+                next = (*i)->m_restartAt;
+        }
+        struct itimerspec its = {};
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000;
+        CHECK(timerfd_settime(m_restartTimer.get(), TFD_TIMER_ABSTIME, &its, NULL) == 0,
+            "timerfd_settime failed: %m");
+    }
+
+    void restartDue()
+    {
+        uint64_t expirations;
+        ssize_t ret = read(m_restartTimer.get(), &expirations, sizeof(expirations));
+        (void)ret;
+        int64_t now = monotonicMS();
+        for(std::vector<daemon_pipe::ProcPtr>::const_iterator i = m_procs.begin(), end = m_procs.end(); i != end; ++i)
+        {
+            if((*i)->m_restartAt && (*i)->m_restartAt <= now)
+                restart(**i);
+        }
+        armRestartTimer();
+    }
+
+    // starts proc again, on the same files, and back in the pipeline's
+    // process group if there's anything left in it
+    void restart(daemon_pipe::Proc &proc)
+    {
+        proc.m_restartAt = 0;
+        --m_pendingRestarts;
+        proc.m_restartTimes.push_back(monotonicMS());
+        ++proc.m_spec->m_restarts;
+        proc.m_spec->resetStatus();
+        proc.m_newPGID = m_pgid > 0 && kill(-m_pgid, 0) == 0 ? m_pgid : 0;
+        try
+        {
+            int pid = start(proc);
+            if(proc.m_newPGID == 0)
+                m_pgid = pid;
+            confirmExecs();
+        }
+        catch(failure &)
+        {
+            // a fork+exec child that couldn't exec gets reaped like any
+            // other, but if we couldn't spawn it at all, it failed here
+            if(!proc.m_spec->started())
+            {
+                proc.m_spec->m_pid = 0;
+                proc.m_spec->m_exited = true;
+                proc.m_spec->m_status = 127 << 8;
+                afterExit(proc);
+            }
+        }
+    }
+
+    // proc won't be restarted, so we can close our ends of its files
+    void giveUp(daemon_pipe::Proc &proc)
+    {
+        proc.m_gaveUp = true;
+        daemon_pipe::File *files[] = { proc.m_stdin, proc.m_stdout, proc.m_stderr };
+        for(size_t f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+        {
+            if(files[f])
+                release(*files[f]);
+        }
+    }
+
+    /// whether waitid takes a pidfd (linux 5.4), which linux 5.3 can
+    /// hand out and poll but not wait on
+    static bool pidfdWaitable()
+    {
+        static int waitable = -1;
+        if(waitable < 0)
+        {
+            // a bad fd is EBADF where P_PIDFD is known, EINVAL where it isn't
+            int ret = syscall(SYS_waitid, WAITID_P_PIDFD, -1, NULL, WEXITED | WNOHANG, NULL);
+            waitable = ret < 0 && errno == EINVAL ? 0 : 1;
+        }
+        return waitable;
+    }
+
+    void reap(daemon_pipe::Proc &proc)
+    {
+        int status = 0;
+        struct rusage usage;
+        if(pidfdWaitable())
+        {
+            siginfo_t info = {};
+            // unlike glibc's waitid(), the syscall fills in a rusage like wait4's
+            int ret = syscall(SYS_waitid, WAITID_P_PIDFD, proc.m_pidfd.get(), &info, WEXITED | WNOHANG, &usage);
+            CHECK(ret >= 0, "waitid pid=%d failed: %m", proc.m_spec->m_pid);
+            if(info.si_pid == 0) // not actually gone yet
+                return;
+            // rebuild the status word waitpid would have given us
+            if(info.si_code == CLD_EXITED)
+                status = (info.si_status & 0xff) << 8;
+            else if(info.si_code == CLD_KILLED)
+                status = info.si_status & 0x7f;
+            else if(info.si_code == CLD_DUMPED)
+                status = (info.si_status & 0x7f) | 0x80;
+        }
+        else
+        {
+            int ret = wait4(proc.m_spec->m_pid, &status, WNOHANG, &usage);
+            CHECK(ret >= 0, "wait4 pid=%d failed: %m", proc.m_spec->m_pid);
+            if(ret == 0)
+                return;
+        }
+
+        // the epoll set only forgets a closed fd once every reference to
+        // its file is gone, so remove it explicitly
+        epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, proc.m_pidfd.get(), NULL);
+        proc.m_pidfd.reset();
+        exited(proc, status, usage);
+    }
+
+    void pollUnwatched()
+    {
+        std::vector<daemon_pipe::Proc *>::iterator i = m_unwatched.begin();
+        while(i != m_unwatched.end())
+        {
+            int status;
+            struct rusage usage;
+            int ret = wait4((*i)->m_spec->m_pid, &status, WNOHANG, &usage);
+            CHECK(ret >= 0, "wait4 failed: %m");
+            if(ret > 0)
+            {
+                exited(**i, status, usage);
+                i = m_unwatched.erase(i);
+            }
+            else
+                ++i;
+        }
+    }
+
+    void readSignals()
+    {
+        struct signalfd_siginfo infos[16];
+        ssize_t ret;
+        while((ret = read(m_signals.get(), infos, sizeof(infos))) > 0)
+        {
+            for(size_t i = 0; i < ret / sizeof(infos[0]); ++i)
+            {
+                int sig = infos[i].ssi_signo;
+                // a signal is read by just one of the harvesters running at
+                // once, so it acts for all of them
+                std::vector<ProcHarvester *> &all = s_harvesters;
+                switch(sig)
                 {
-                    if((*i)->m_spec->running() && (*i)->m_spec->m_forwardSignals)
+                // forward these signals onto any of our children that have m_forwardSignals set.
+                case SIGTERM:
+                case SIGINT:
+                case SIGQUIT:
+                    // and since we're being shut down, stop restarting
+                    for(std::vector<ProcHarvester *>::const_iterator h = all.begin(), end = all.end(); h != end; ++h)
                     {
-                        CHECK(kill((*i)->m_spec->m_pid, sig) == 0, "kill pid=%d sig=%d failed: %m",
-                                (*i)->m_spec->m_pid, sig);
+                        (*h)->stop();
+                        (*h)->forward(sig);
                     }
-                }
-                break;
+                    break;
 
-            case SIGCHLD: // this'll cause us to reloop and wait for or children
+                case SIGCHLD: // only children without a pidfd need this
+                    for(std::vector<ProcHarvester *>::const_iterator h = all.begin(), end = all.end(); h != end; ++h)
+                        (*h)->pollUnwatched();
+                    break;
 
-            case SIGHUP:  // we want to just ignore this
+                case SIGHUP:  // we want to just ignore this
 
-            case SIGPIPE: // this could mean bblogger died in try_error_write.
-                          // ignore; we'll get EPIPE from ::write() which'll 
-                          // cause us to just write to stderr.
+                case SIGPIPE: // this could mean bblogger died in try_error_write.
+                              // ignore; we'll get EPIPE from ::write() which'll
+                              // cause us to just write to stderr.
 
-            default:
-                break;
+                default:
+                    break;
+                }
             }
         }
+        CHECK(ret >= 0 || errno == EAGAIN, "read from signalfd failed: %m");
     }
 
-    std::vector<daemon_pipe::ProcPtr> m_procs;
-    const sigset_t *m_sigset;
+    void forward(int sig)
+    {
+        for(std::vector<daemon_pipe::Proc *>::const_iterator i = m_forwarders.begin(), end = m_forwarders.end();
+              i != end; ++i)
+        {
+            daemon_pipe::Proc &proc = **i;
+            if(!proc.m_spec->running())
+                continue;
+            // the pidfd can't be pointing at a recycled pid
+            int ret = proc.m_pidfd.isOk()
+                ? syscall(SYS_pidfd_send_signal, proc.m_pidfd.get(), sig, NULL, 0)
+                : kill(proc.m_spec->m_pid, sig);
+            CHECK(ret == 0, "kill pid=%d sig=%d failed: %m", proc.m_spec->m_pid, sig);
+        }
+    }
+
+    PumpSet *m_pumps;
+    FD m_epoll, m_signals, m_restartTimer;
+    size_t m_running; // started children that we haven't reaped yet
+    size_t m_pendingRestarts; // reaped children waiting to be restarted
+    bool m_stopping;
+    std::vector<daemon_pipe::Proc *> m_forwarders, m_unwatched;
+
+    static std::vector<ProcHarvester *> s_harvesters; // all that exist
+};
+std::vector<ProcHarvester *> ProcHarvester::s_harvesters;
+
+/// The state of a daemon_pipe between start() and the end of the last child.
+/// The members are torn down in the reverse order: the ProcHarvester waits
+/// for whatever is left, then the pumps go, the lock file is unlocked and
+/// the signal mask is restored.
+struct daemon_pipe::Running
+{
+    Running() : m_harvester(&m_signals.m_sigset, &m_pumps) {}
+
+    SignalBlocker m_signals;
+    LockFile m_lock;
+    PumpSet m_pumps;
+    // the files children may be restarted on. The harvester releases them
+    // before it waits, and the procs point into them, so they outlive it.
+    FileMap m_files;
+    // and the cgroups, which once the children are gone kill whatever they
+    // left behind: the pipeline's, then any the procs have inside it
+    boost::scoped_ptr<Cgroup> m_cgroup;
+    std::vector<boost::shared_ptr<Cgroup> > m_procCgroups;
+    ProcHarvester m_harvester;
 };
 
 void daemon_pipe::LockFile::open(const std::string &file)
@@ -345,24 +970,22 @@ daemon_pipe::LockFile::~LockFile()
     }
 }
 
-void daemon_pipe::exec()
+void daemon_pipe::start()
 {
     CHECK(!m_specs.empty(), "no procs to execute");
+    CHECK(!m_run, "daemon_pipe is already running");
 
-    SignalBlocker signals;
-
-    // LockFile will be unlocked on destruction; don't do this until
-    // after the ProcHarvester is destroyed
-    LockFile lock;
-
-    // ProcHarvester will wait for all children on destruction. Since we want
-    // all the FDs to get closed before that happens, this must be instantiated
-    // before the FileMap.
-    ProcHarvester harvester(&signals.m_sigset);
+    // If we don't get as far as keeping it, the Running waits for whatever
+    // we did start on destruction, after closing all the FDs below.
+    boost::shared_ptr<Running> run(new Running);
+    SignalBlocker &signals = run->m_signals;
+    LockFile &lock = run->m_lock;
+    PumpSet &pumps = run->m_pumps;
+    ProcHarvester &harvester = run->m_harvester;
 
     // build a map of all the files we're going to need to open, and whether
     // we need to read or write from them
-    FileMap files;
+    FileMap &files = run->m_files;
     for(std::vector<daemon_proc_spec_ptr>::iterator i = m_specs.begin(), end = m_specs.end(); i != end; ++i)
     {
         Proc &proc(harvester.addProc(*i));
@@ -374,6 +997,14 @@ void daemon_pipe::exec()
         if((*i)->m_stderr)
             proc.m_stderr = files.get((*i)->m_stderr, false, true);
     }
+    for(std::vector<File *>::const_iterator file = files.m_files.begin(), end = files.m_files.end(); file != end; ++file)
+    {
+        const file_spec &spec = *(*file)->m_spec;
+        CHECK(spec.m_teeReaders == 0 || int((*file)->m_branches.size()) == spec.m_teeReaders,
+            "tee(%d) has %d readers", spec.m_teeReaders, int((*file)->m_branches.size()));
+        CHECK(!spec.m_logSink || !(*file)->m_wantRead, "log_sink %s cannot be used for reading",
+            spec.m_logSink->m_path.c_str());
+    }
 
     if(!m_lockFile.empty())
         lock.open(m_lockFile);
@@ -383,16 +1014,190 @@ void daemon_pipe::exec()
     for(; file != end; ++file)
         (*file)->open();
 
-    int pgid = 0;
-    for(std::vector<ProcPtr>::iterator i = harvester.m_procs.begin(), end = harvester.m_procs.end(); i != end; ++i)
+    // the parent's ends of the tees and log sinks belong to their pumps
+    // from here on
+    for(file = files.m_files.begin(); file != end; ++file)
+    {
+        if((*file)->m_spec->m_logSink)
+            pumps.add(new LogSinkPump((*file)->m_readSide, (*file)->m_spec->m_logSink));
+        if((*file)->m_spec->m_teeReaders == 0)
+            continue;
+        std::vector<FDPtr> outputs;
+        for(std::vector<File *>::const_iterator b = (*file)->m_branches.begin(), bend = (*file)->m_branches.end();
+                b != bend; ++b)
+            outputs.push_back((*b)->m_writeSide);
+        pumps.add(new TeePump((*file)->m_readSide, outputs, (*file)->m_spec->m_teePolicy));
+    }
+
+    // the sizer is only made for a pipeline with adaptive pipes, and the
+    // pump set owns it from the start
+    PipeSizer *sizer = NULL;
+    for(file = files.m_files.begin(); file != end; ++file)
+    {
+        if(!(*file)->m_spec->m_adaptivePipe)
+            continue;
+        std::vector<Proc *> readers;
+        for(std::vector<ProcPtr>::const_iterator i = harvester.m_procs.begin(), pend = harvester.m_procs.end(); i != pend; ++i)
+        {
+            if((*i)->m_stdin == *file)
+                readers.push_back(i->get());
+        }
+        if(!sizer)
+            pumps.add(sizer = new PipeSizer);
+        sizer->addPipe((*file)->m_spec, *(*file)->m_readSide, readers);
+    }
+
+    makeCgroups(*run);
+
+    // every child is started before we hear back from any of them. If one
+    // can't be, the ones which were get torn down together.
+    try
+    {
+        int &pgid = harvester.m_pgid;
+        for(std::vector<ProcPtr>::iterator i = harvester.m_procs.begin(), end = harvester.m_procs.end(); i != end; ++i)
+        {
+            Proc &proc = **i;
+            proc.m_blockedSignals = &signals;
+            proc.m_newPGID = pgid;
+            proc.m_useFork = m_useFork;
+            int pid = harvester.start(proc);
+            if(pgid == 0)
+                pgid = pid;
+        }
+        harvester.confirmExecs();
+    }
+    catch(...)
+    {
+        harvester.terminate(SIGTERM);
+        if(run->m_cgroup.get())
+            run->m_cgroup->kill();
+        for(file = files.m_files.begin(); file != end; ++file)
+            (*file)->close();
+        throw;
+    }
+
+    // only the children which may be restarted still need their files
+    for(file = files.m_files.begin(); file != end; ++file)
+        harvester.release(**file);
+    m_run = run;
+}
+
+// puts the pipeline in a cgroup of its own if it wants one, or if any of
+// its procs do. Those need controllers enabled in the pipeline's cgroup,
+// which then can't have processes of its own, so each proc gets a cgroup.
+void daemon_pipe::makeCgroups(Running &run)
+{
+    bool procCgroups = false;
+    for(std::vector<daemon_proc_spec_ptr>::const_iterator i = m_specs.begin(), end = m_specs.end(); i != end; ++i)
+        procCgroups = procCgroups || (*i)->m_cgroup;
+    if(!m_cgroup && !procCgroups)
+        return;
+
+    static int pipelines = 0;
+    const cgroup_spec &spec = m_cgroup ? *m_cgroup : cgroup_spec();
+    std::string parent = spec.m_parent.empty() ? Cgroup::ownCgroup() : spec.m_parent;
+    char name[64];
+    snprintf(name, sizeof(name), "/with-pipeline-%d-%d", int(getpid()), pipelines++);
+    Cgroup::enableControllers(parent, spec);
+    run.m_cgroup.reset(new Cgroup(parent + name, spec));
+    run.m_harvester.m_cgroup = run.m_cgroup.get();
+
+    std::vector<ProcPtr> &procs = run.m_harvester.m_procs;
+    for(size_t i = 0; i < procs.size(); ++i)
+    {
+        if(!procCgroups)
+        {
+            procs[i]->m_cgroupFD = run.m_cgroup->fd();
+            continue;
+        }
+        const cgroup_spec &procSpec = procs[i]->m_spec->m_cgroup ? *procs[i]->m_spec->m_cgroup : cgroup_spec();
+        snprintf(name, sizeof(name), "/proc-%d", int(i));
+        Cgroup::enableControllers(run.m_cgroup->path(), procSpec);
+        run.m_procCgroups.push_back(boost::shared_ptr<Cgroup>(new Cgroup(run.m_cgroup->path() + name, procSpec)));
+        procs[i]->m_cgroupFD = run.m_procCgroups.back()->fd();
+    }
+}
+
+void daemon_pipe::kill_all()
+{
+    if(!m_run)
+        return;
+    m_run->m_harvester.terminate(SIGKILL);
+    if(m_run->m_cgroup.get())
+        m_run->m_cgroup->kill();
+}
+
+bool daemon_pipe::poll(int timeoutMS)
+{
+    if(!m_run)
+        return true;
+
+    ProcHarvester &harvester = m_run->m_harvester;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!harvester.done())
     {
-        Proc &proc = **i;
-        proc.m_blockedSignals = &signals;
-        proc.m_newPGID = pgid;
-        int pid = proc.safe_fork_exec();
-        if(pgid == 0)
-            pgid = pid;
+        int left = -1;
+        if(timeoutMS >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            left = std::max(timeoutMS - elapsed, 0L);
+        }
+        harvester.step(left);
+        if(left == 0)
+            break;
     }
+    if(!harvester.done())
+        return false;
+
+    m_run.reset();
+    return true;
+}
+
+void daemon_pipe::wait()
+{
+    poll(-1);
+}
+
+void daemon_pipe::exec()
+{
+    start();
+    wait();
+}
+
+int daemon_pipe::fd() const
+{
+    return m_run ? m_run->m_harvester.fd() : -1;
+}
+
+file_spec_ptr daemon_pipe::add_pipe(int size, bool adaptive)
+{
+    CHECK(size >= 0, "pipe size must not be negative");
+    file_spec_ptr spec(new file_spec);
+    spec->m_pipeSize = size;
+    spec->m_adaptivePipe = adaptive;
+    return spec;
+}
+
+file_spec_ptr daemon_pipe::add_tee(int readers, file_spec::tee_policy policy)
+{
+    CHECK(readers > 0, "tee needs at least one reader, not %d", readers);
+    file_spec_ptr spec(new file_spec);
+    spec->m_teeReaders = readers;
+    spec->m_teePolicy = policy;
+    return spec;
+}
+
+file_spec_ptr daemon_pipe::add_log_sink(const log_sink_spec_ptr &logSink)
+{
+    CHECK(!logSink->m_path.empty(), "log_sink needs a path");
+    CHECK(logSink->m_keep >= 0, "log_sink keep must not be negative");
+    CHECK(logSink->m_flushMS >= 0, "log_sink flush_ms must not be negative");
+    CHECK(logSink->m_rotateSecs >= 0, "log_sink rotate_secs must not be negative");
+    file_spec_ptr spec(new file_spec);
+    spec->m_logSink = logSink;
+    return spec;
 }
 
 void daemon_pipe::try_error_write(const std::string &input)
@@ -415,11 +1220,13 @@ void daemon_pipe::try_error_write(const std::string &input)
             file.m_writeSide->setNonBlock();
 
             Proc &proc(harvester.addProc(procSpec));
+            harvester.stop(); // it only gets the one message to write
 
             proc.m_stdin = &file;
             proc.m_blockedSignals = &signals;
             proc.m_newPGID = 0;
-            proc.safe_fork_exec();
+            harvester.start(proc);
+            harvester.confirmExecs();
             file.m_readSide->reset();
 
             int ret = ::write(file.m_writeSide->get(), input.c_str(), input.length());
@@ -6,6 +6,9 @@
 #include <string.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <deque>
 
 #include <boost/shared_ptr.hpp>
 
@@ -35,8 +38,12 @@ protected:
 };
 typedef boost::shared_ptr<FD> FDPtr;
 
+/// the largest buffer a pipe can be given without CAP_SYS_RESOURCE
+int pipeMaxSize();
+
 /// Installs a sigprocmask to block signals, and restores the
-/// mask on exit.
+/// mask on exit. Blockers nest: the mask is restored when the last one goes,
+/// whatever order they go in, so that several daemon_pipes can run at once.
 struct SignalBlocker
 {
     SignalBlocker();
@@ -45,28 +52,92 @@ struct SignalBlocker
     /// restores the sigprocmask. our children processes call this; note that this leaves HUP ignored.
     void unblock();
 
-    sigset_t m_sigset, m_oldset;
-    struct sigaction m_oldHUPAction;
+    sigset_t m_sigset;
+    sigset_t m_oldset; // the mask from before the first blocker
+};
+
+/// The settings and counters of a dp:log_sink; see LogSinkPump
+struct log_sink_spec : public boost::noncopyable
+{
+    log_sink_spec()
+        : m_maxBytes(0)
+        , m_keep(5)
+        , m_flushMS(1000)
+        , m_rotateSecs(0)
+        , m_bytesWritten(0)
+        , m_rotations(0) {}
+    std::string m_path;
+    unsigned long long m_maxBytes; // rotate before the file grows past this; 0 for never
+    int m_keep;                    // rotated files to keep, as m_path.1 (the newest) .. m_path.<keep>
+    int m_flushMS;                 // the longest output waits in our buffer; 0 writes it straight away
+    int m_rotateSecs;              // rotate a file once it's this old; 0 for never
+
+    unsigned long long m_bytesWritten;
+    int m_rotations;
 };
+typedef boost::shared_ptr<log_sink_spec> log_sink_spec_ptr;
+
+/// The settings of the cgroup v2 directory a pipeline, or one of its procs,
+/// runs in; see Cgroup
+struct cgroup_spec
+{
+    cgroup_spec() : m_ioWeight(0) {}
+    std::string m_parent;    // pipelines only: where the cgroup is made; empty for the caller's own cgroup
+    std::string m_cpuMax;    // cpu.max, e.g. "50000 100000"; empty leaves it alone
+    std::string m_memoryMax; // memory.max, e.g. "512M"; empty leaves it alone
+    int m_ioWeight;          // io.weight, 1-10000; 0 leaves it alone
+};
+typedef boost::shared_ptr<cgroup_spec> cgroup_spec_ptr;
 
 struct file_spec : public boost::noncopyable
 {
-    file_spec() : m_filename(), m_append(false) {}
+    /// what a tee does with a reader that can't keep up; see TeePump
+    enum tee_policy { TEE_BLOCK, TEE_DROP, TEE_SPILL };
+
+    file_spec()
+        : m_filename()
+        , m_append(false)
+        , m_pipeSize(0)
+        , m_adaptivePipe(false)
+        , m_actualPipeSize(0)
+        , m_teeReaders(0)
+        , m_teePolicy(TEE_BLOCK) {}
     file_spec(std::string const &s, bool append = false)
         : m_filename(s)
-        , m_append(append) {}
-    std::string m_filename;
+        , m_append(append)
+        , m_pipeSize(0)
+        , m_adaptivePipe(false)
+        , m_actualPipeSize(0)
+        , m_teeReaders(0)
+        , m_teePolicy(TEE_BLOCK) {}
+    std::string m_filename; // empty for pipes, tees and log sinks
     bool m_append;
+    int m_pipeSize;       // the buffer size to give a pipe; 0 leaves the kernel's default
+    bool m_adaptivePipe;  // grow the buffer while the pipe keeps filling up; see PipeSizer
+    int m_actualPipeSize; // the buffer size the pipe has, once it's been opened
+    int m_teeReaders; // > 0 for a tee: each of its readers gets all that's written to it
+    tee_policy m_teePolicy;
+    log_sink_spec_ptr m_logSink; // set for a log sink, a pipe we read into a log file
 };
 typedef boost::shared_ptr<file_spec> file_spec_ptr;
 
 struct daemon_proc_spec : public boost::noncopyable
 {
+    /// whether a proc that exits while the rest of its pipeline runs is
+    /// started again
+    enum restart_policy { RESTART_NO, RESTART_ON_FAILURE, RESTART_ALWAYS };
+
     daemon_proc_spec()
         : m_forwardSignals(false)
         , m_stdin()
         , m_stdout()
         , m_stderr()
+        , m_restart(RESTART_NO)
+        , m_backoffMinMS(100)
+        , m_backoffMaxMS(10000)
+        , m_maxRestartsPerMin(0)
+        , m_restarts(0)
+        , m_crashLooping(false)
     { resetStatus(); }
 
     void resetStatus()
@@ -74,6 +145,8 @@ struct daemon_proc_spec : public boost::noncopyable
         m_pid = -1;
         m_exited = false;
         m_status = 0;
+        m_startTime = m_endTime = m_wallTime = 0;
+        memset(&m_rusage, 0, sizeof(m_rusage));
     }
 
     bool started() const { return m_pid != -1; }
@@ -88,11 +161,26 @@ struct daemon_proc_spec : public boost::noncopyable
     int m_pid;
     bool m_exited;
     int m_status;
+
+    // what the last run of the proc cost, filled in when it's reaped
+    double m_startTime, m_endTime; // seconds since the epoch
+    double m_wallTime;             // seconds, by CLOCK_MONOTONIC
+    struct rusage m_rusage;        // of the proc and the children it waited for
+
+    restart_policy m_restart;
+    int m_backoffMinMS, m_backoffMaxMS; // the wait before a restart doubles from min up to max
+    int m_maxRestartsPerMin; // past this, the proc is left dead; 0 for no limit
+    int m_restarts;          // this run
+    bool m_crashLooping;     // restarts stopped because of m_maxRestartsPerMin
+
+    cgroup_spec_ptr m_cgroup; // set to run the proc in a cgroup of its own, within the pipeline's
 };
 typedef boost::shared_ptr<daemon_proc_spec> daemon_proc_spec_ptr;
 
 struct daemon_pipe : public boost::noncopyable
 {
+    daemon_pipe() : m_useFork(false) {}
+
     struct File
     {
         File(const file_spec_ptr &spec)
@@ -103,7 +191,10 @@ struct daemon_pipe : public boost::noncopyable
         file_spec_ptr m_spec;
         bool m_append, m_wantRead, m_wantWrite;
         FDPtr m_readSide, m_writeSide;
+        std::vector<File *> m_branches; // for a tee, the pipes of its readers
         void open();
+        /// drops our ends; pumps keep the ones they were given
+        void close() { m_readSide.reset(); m_writeSide.reset(); }
     };
 
     // serves as a map from file_spec to File, using an unsorted list
@@ -128,6 +219,16 @@ struct daemon_pipe : public boost::noncopyable
                 f = new File(spec);
                 m_files.push_back(f);
             }
+            if(wantRead && spec->m_teeReaders > 0)
+            {
+                // each reader of a tee gets a pipe of its own, which a
+                // TeePump copies the tee's pipe into
+                File *branch = new File(file_spec_ptr(new file_spec));
+                m_files.push_back(branch);
+                f->m_branches.push_back(branch);
+                f->m_wantRead = true;
+                f = branch;
+            }
 
             f->m_wantRead = f->m_wantRead || wantRead;
             f->m_wantWrite = f->m_wantWrite || wantWrite;
@@ -143,17 +244,43 @@ struct daemon_pipe : public boost::noncopyable
             , m_stdout(NULL)
             , m_stderr(NULL)
             , m_newPGID(-1)
-            , m_blockedSignals(NULL) {}
+            , m_blockedSignals(NULL)
+            , m_useFork(false)
+            , m_cgroupFD(-1)
+            , m_startedAt(0)
+            , m_startedAtSecs(0)
+            , m_restartAt(0)
+            , m_backoffMS(0)
+            , m_gaveUp(false) {}
+        // starts the child. With fork+exec, this doesn't wait to hear
+        // whether the exec worked; see ProcHarvester::confirmExecs
+        int start() { return m_useFork ? safe_fork_exec() : safe_spawn(); }
         int safe_fork_exec();
+        int safe_spawn();
 
         daemon_proc_spec_ptr m_spec;
         File *m_stdin, *m_stdout, *m_stderr;
         int m_newPGID;
         SignalBlocker *m_blockedSignals;
+        bool m_useFork; // use safe_fork_exec instead of safe_spawn
+        int m_cgroupFD; // the cgroup to start the child in, or -1
+        FD m_pidfd; // set by ProcHarvester while the child is running
+        FD m_execErrors; // safe_fork_exec: where the child says why it couldn't exec
+
+        // restarts, all CLOCK_MONOTONIC milliseconds; see ProcHarvester
+        bool restartable() const { return m_spec->m_restart != daemon_proc_spec::RESTART_NO && !m_gaveUp; }
+        int64_t m_startedAt;
+        double m_startedAtSecs; // for daemon_proc_spec::m_wallTime
+        int64_t m_restartAt; // when it's due to be restarted, 0 if it isn't
+        int m_backoffMS;     // the last wait before a restart
+        std::deque<int64_t> m_restartTimes; // the restarts in the last minute
+        bool m_gaveUp;       // it won't be restarted any more
     };
     typedef boost::shared_ptr<Proc> ProcPtr;
 
-    file_spec_ptr add_pipe() { return file_spec_ptr(new file_spec); }
+    file_spec_ptr add_pipe(int size = 0, bool adaptive = false);
+    file_spec_ptr add_tee(int readers, file_spec::tee_policy policy = file_spec::TEE_BLOCK);
+    file_spec_ptr add_log_sink(const log_sink_spec_ptr &logSink);
     file_spec_ptr add_file(const std::string &filename)
         { return file_spec_ptr(new file_spec(filename)); }
     file_spec_ptr add_file(const std::string &filename, bool append)
@@ -169,10 +296,30 @@ struct daemon_pipe : public boost::noncopyable
 
     void add_proc(const daemon_proc_spec_ptr &spec)
         { m_specs.push_back(spec); }
+    /// in the order they were added
+    const std::vector<daemon_proc_spec_ptr> &procs() const { return m_specs; }
 
     std::string m_lockFile;
+    bool m_useFork; // fork+exec every stage before waiting on any exec, rather than posix_spawn each in turn
+    cgroup_spec_ptr m_cgroup; // set to run the pipeline in a cgroup of its own
 
+    /// starts every proc and returns. The procs' statuses are updated as
+    /// poll() or wait() reap them.
+    void start();
+    /// does whatever there is to do for up to timeoutMS (-1 for as long as
+    /// it takes), and returns true once every proc has exited
+    bool poll(int timeoutMS);
+    void wait();
+    /// start() and wait()
     void exec();
+    /// while running, an fd which is readable whenever poll() has work;
+    /// otherwise -1
+    int fd() const;
+    bool running() const { return m_run.get() != NULL; }
+    /// SIGKILLs every proc, and in a cgroup everything they started too.
+    /// Nothing is restarted afterwards; poll() or wait() still reap them.
+    void kill_all();
+
     void try_error_write(const std::string &input);
 
 private:
@@ -191,8 +338,12 @@ private:
         return member;
     }
 
+    struct Running;
+    void makeCgroups(Running &run);
+
     std::vector<daemon_proc_spec_ptr> m_specs;
     file_spec_ptr m_devnull, m_caller_stdout, m_caller_stderr, m_caller_stdin;
+    boost::shared_ptr<Running> m_run; // between start() and the end of the last proc
 
     friend struct ProcHarvester;
 };
@@ -0,0 +1,603 @@
+#include "pump.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+
+#ifndef O_TMPFILE // linux 3.11, glibc 2.19
+#define O_TMPFILE (020000000 | O_DIRECTORY)
+#endif
+
+#define CHECK(cond, fmt...) \
+    do { \
+        if(!(cond)) \
+            throw failure(fmt); \
+    } while(0)
+
+void Pump::watch(int fd, uint32_t events)
+{
+    m_set->watch(this, fd, events);
+}
+
+PumpSet::PumpSet()
+{
+    m_epoll.reset(epoll_create1(EPOLL_CLOEXEC));
+    CHECK(m_epoll.isOk(), "epoll_create1 failed: %m");
+}
+
+PumpSet::~PumpSet()
+{
+    std::for_each(m_pumps.begin(), m_pumps.end(), boost::checked_deleter<Pump>());
+}
+
+void PumpSet::add(Pump *pump)
+{
+    m_pumps.push_back(pump);
+    pump->m_set = this;
+    pump->start();
+}
+
+bool PumpSet::active() const
+{
+    for(std::vector<Pump *>::const_iterator i = m_pumps.begin(), end = m_pumps.end(); i != end; ++i)
+    {
+        if(!(*i)->finished())
+            return true;
+    }
+    return false;
+}
+
+void PumpSet::run()
+{
+    struct epoll_event events[64];
+    int n = epoll_wait(m_epoll.get(), events, sizeof(events) / sizeof(events[0]), 0);
+    CHECK(n >= 0 || errno == EINTR, "epoll_wait failed: %m");
+    for(int i = 0; i < n; ++i)
+    {
+        // an earlier pump in this batch may have stopped watching it
+        WatchMap::const_iterator w = m_watched.find(events[i].data.fd);
+        if(w != m_watched.end())
+            w->second.first->ready(events[i].data.fd, events[i].events);
+    }
+}
+
+void PumpSet::watch(Pump *pump, int fd, uint32_t events)
+{
+    WatchMap::iterator w = m_watched.find(fd);
+    if(w != m_watched.end() && w->second.second == events)
+        return;
+
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if(events == 0)
+    {
+        if(w != m_watched.end())
+        {
+            CHECK(epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, fd, NULL) == 0, "epoll_ctl failed: %m");
+            m_watched.erase(w);
+        }
+    }
+    else if(w == m_watched.end())
+    {
+        CHECK(epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, fd, &ev) == 0, "epoll_ctl failed: %m");
+        m_watched[fd] = std::make_pair(pump, events);
+    }
+    else
+    {
+        CHECK(epoll_ctl(m_epoll.get(), EPOLL_CTL_MOD, fd, &ev) == 0, "epoll_ctl failed: %m");
+        w->second.second = events;
+    }
+}
+
+TeePump::TeePump(const FDPtr &input, const std::vector<FDPtr> &outputs, file_spec::tee_policy policy)
+    : m_input(input)
+    , m_branches(outputs.size())
+    , m_live(outputs.size())
+    , m_policy(policy)
+{
+    m_input->setNonBlock();
+    for(size_t i = 0; i < outputs.size(); ++i)
+    {
+        m_branches[i].m_fd = outputs[i];
+        m_branches[i].m_fd->setNonBlock();
+    }
+    // what every reader already has is consumed by splicing it here
+    m_devnull.reset(::open("/dev/null", O_WRONLY | O_CLOEXEC));
+    CHECK(m_devnull.isOk(), "open /dev/null failed: %m");
+}
+
+void TeePump::start()
+{
+    updateWatches();
+}
+
+void TeePump::ready(int fd, uint32_t events)
+{
+    if(m_input->isOk() && fd == m_input->get())
+        pumpInput(events);
+    else
+    {
+        for(std::vector<Branch>::iterator b = m_branches.begin(), end = m_branches.end(); b != end; ++b)
+        {
+            if(b->m_fd->isOk() && fd == b->m_fd->get())
+                drain(*b);
+        }
+    }
+    updateWatches();
+}
+
+void TeePump::pumpInput(uint32_t events)
+{
+    int avail = 0;
+    CHECK(ioctl(m_input->get(), FIONREAD, &avail) == 0, "ioctl(FIONREAD) failed: %m");
+    if(avail == 0)
+    {
+        if(events & (EPOLLHUP | EPOLLERR)) // every writer is gone
+            closeInput();
+        return;
+    }
+
+    // tee the chunk into every reader which isn't behind. least ends up as
+    // the part of it which every reader that still wants it has.
+    std::vector<size_t> copied(m_branches.size(), 0);
+    size_t least = avail;
+    for(size_t i = 0; i < m_branches.size(); ++i)
+    {
+        Branch &b = m_branches[i];
+        if(!b.m_fd->isOk())
+            continue;
+        if(!b.behind())
+        {
+            ssize_t ret = tee(m_input->get(), b.m_fd->get(), avail, SPLICE_F_NONBLOCK);
+            if(ret < 0 && errno == EPIPE)
+            {
+                closeBranch(b);
+                continue;
+            }
+            CHECK(ret >= 0 || errno == EAGAIN, "tee failed: %m");
+            copied[i] = std::max(ret, ssize_t(0));
+        }
+        if(m_policy != file_spec::TEE_DROP)
+            least = std::min(least, copied[i]);
+    }
+
+    // throw away what everyone has without copying it, and read the rest
+    // so it can be kept for whoever is missing it
+    while(least > 0)
+    {
+        ssize_t ret = splice(m_input->get(), NULL, m_devnull.get(), NULL, least, 0);
+        CHECK(ret > 0, "splice to /dev/null failed: %m");
+        least -= ret;
+        avail -= ret;
+        for(size_t i = 0; i < copied.size(); ++i)
+            copied[i] -= std::min(copied[i], size_t(ret));
+    }
+    if(avail > 0)
+    {
+        m_buf.resize(avail);
+        ssize_t ret = read(m_input->get(), &m_buf[0], avail);
+        CHECK(ret == avail, "read from tee failed: %m");
+        for(size_t i = 0; i < m_branches.size(); ++i)
+        {
+            if(m_branches[i].m_fd->isOk() && copied[i] < size_t(avail))
+                keep(m_branches[i], &m_buf[copied[i]], avail - copied[i]);
+        }
+    }
+}
+
+void TeePump::keep(Branch &branch, const char *buf, size_t len)
+{
+    if(m_policy == file_spec::TEE_BLOCK)
+    {
+        branch.m_backlog.append(buf, len);
+        return;
+    }
+    if(m_policy == file_spec::TEE_SPILL)
+    {
+        if(!branch.m_spill)
+        {
+            const char *dir = getenv("TMPDIR");
+            branch.m_spill.reset(new FD(::open(dir && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)));
+        }
+        // if the disk is full or there's no spill file, the reader loses it
+        while(len > 0 && branch.m_spill->isOk())
+        {
+            ssize_t ret = pwrite(branch.m_spill->get(), buf, len, branch.m_spillWrite);
+            if(ret <= 0)
+                break;
+            buf += ret;
+            len -= ret;
+            branch.m_spillWrite += ret;
+        }
+    }
+    // TEE_DROP, or the spill failed: the reader just doesn't get it
+}
+
+void TeePump::drain(Branch &branch)
+{
+    ssize_t ret;
+    if(!branch.m_backlog.empty())
+    {
+        ret = write(branch.m_fd->get(), branch.m_backlog.data(), branch.m_backlog.size());
+        if(ret > 0)
+            branch.m_backlog.erase(0, ret);
+    }
+    else if(branch.m_spillRead != branch.m_spillWrite)
+    {
+        ret = splice(branch.m_spill->get(), &branch.m_spillRead, branch.m_fd->get(), NULL,
+            branch.m_spillWrite - branch.m_spillRead, SPLICE_F_NONBLOCK);
+        if(ret >= 0 && branch.m_spillRead == branch.m_spillWrite)
+        {
+            // caught up; give the disk space back
+            CHECK(ftruncate(branch.m_spill->get(), 0) == 0, "ftruncate of tee spill file failed: %m");
+            branch.m_spillRead = branch.m_spillWrite = 0;
+        }
+    }
+    else
+        return;
+
+    if(ret < 0 && errno == EPIPE)
+        closeBranch(branch);
+    else
+        CHECK(ret >= 0 || errno == EAGAIN, "write to tee reader failed: %m");
+}
+
+void TeePump::closeBranch(Branch &branch)
+{
+    watch(branch.m_fd->get(), 0);
+    branch.m_fd->reset();
+    branch.m_backlog.clear();
+    branch.m_spill.reset();
+    branch.m_spillRead = branch.m_spillWrite = 0;
+    --m_live;
+}
+
+void TeePump::closeInput()
+{
+    watch(m_input->get(), 0);
+    m_input->reset();
+}
+
+void TeePump::updateWatches()
+{
+    // with no readers left, the writer gets EPIPE like it would from a pipe
+    if(m_live == 0 && m_input->isOk())
+        closeInput();
+
+    // once the input is done, readers which have had everything see EOF
+    bool anyBehind = false;
+    for(std::vector<Branch>::iterator b = m_branches.begin(), end = m_branches.end(); b != end; ++b)
+    {
+        if(!b->m_fd->isOk())
+            continue;
+        if(!b->behind() && !m_input->isOk())
+            closeBranch(*b);
+        else
+        {
+            watch(b->m_fd->get(), b->behind() ? uint32_t(EPOLLOUT) : uint32_t(0));
+            anyBehind = anyBehind || b->behind();
+        }
+    }
+
+    // a blocking tee stops reading until everyone has caught up. The input
+    // is taken out of the set rather than given no events, since a hangup
+    // is reported regardless.
+    if(m_input->isOk())
+        watch(m_input->get(), m_policy == file_spec::TEE_BLOCK && anyBehind ? uint32_t(0) : uint32_t(EPOLLIN));
+}
+
+#define LOG_SINK_FLUSH_BYTES (64 * 1024)
+#define LOG_SINK_MAX_BUFFER (4 * 1024 * 1024)
+#define LOG_SINK_RETRY_MS 100 // between attempts to write out the rest, once the writers are gone
+
+static time_t monotonicSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+LogSinkPump::LogSinkPump(const FDPtr &input, const log_sink_spec_ptr &spec)
+    : m_input(input)
+    , m_spec(spec)
+    , m_logSize(0)
+    , m_openedAt(0)
+{
+    m_input->setNonBlock();
+    CHECK(openLog(0), "open %s failed: %m", m_spec->m_path.c_str());
+
+    // the timer flushes the buffer and checks the age of the file
+    int intervalMS = m_spec->m_flushMS > 0 ? m_spec->m_flushMS : 1000;
+    m_timer.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    CHECK(m_timer.isOk(), "timerfd_create failed: %m");
+    struct itimerspec its = {};
+    its.it_interval.tv_sec = intervalMS / 1000;
+    its.it_interval.tv_nsec = (intervalMS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    CHECK(timerfd_settime(m_timer.get(), 0, &its, NULL) == 0, "timerfd_settime failed: %m");
+}
+
+void LogSinkPump::start()
+{
+    watch(m_timer.get(), EPOLLIN);
+    updateWatches();
+}
+
+void LogSinkPump::ready(int fd, uint32_t)
+{
+    if(m_input->isOk() && fd == m_input->get())
+        readInput();
+    else if(m_timer.isOk() && fd == m_timer.get())
+    {
+        uint64_t expirations;
+        ssize_t ret = read(m_timer.get(), &expirations, sizeof(expirations));
+        (void)ret;
+        if(!m_input->isOk()) // the writers are gone, and the rest is still to go
+            drain();
+        else if(flush() && m_spec->m_rotateSecs > 0 && m_logSize > 0
+                && monotonicSeconds() - m_openedAt >= m_spec->m_rotateSecs)
+            rotate();
+    }
+    if(m_input->isOk())
+        updateWatches();
+}
+
+void LogSinkPump::readInput()
+{
+    char buf[LOG_SINK_FLUSH_BYTES];
+    while(m_buf.size() < LOG_SINK_MAX_BUFFER)
+    {
+        ssize_t ret = read(m_input->get(), buf, sizeof(buf));
+        if(ret == 0) // every writer is gone
+        {
+            watch(m_input->get(), 0);
+            m_input->reset();
+            drain();
+            return;
+        }
+        if(ret < 0)
+        {
+            CHECK(errno == EAGAIN || errno == EINTR, "read from log sink failed: %m");
+            break;
+        }
+        m_buf.append(buf, ret);
+    }
+    if(m_spec->m_flushMS == 0 || m_buf.size() >= LOG_SINK_FLUSH_BYTES)
+        flush();
+}
+
+// writes out the buffer, rotating wherever max_bytes says to. Returns false
+// if the log file couldn't take all of it.
+bool LogSinkPump::flush()
+{
+    const unsigned long long maxBytes = m_spec->m_maxBytes;
+    while(!m_buf.empty())
+    {
+        if(!m_log.isOk() && !openLog(0))
+            return false;
+
+        size_t len = m_buf.size();
+        bool full = false;
+        if(maxBytes > 0 && m_logSize + len > maxBytes)
+        {
+            // up to the last line break which fits. A line longer than
+            // max_bytes gets split, rather than the file outgrowing it.
+            size_t room = m_logSize < maxBytes ? maxBytes - m_logSize : 0;
+            size_t lineEnd = room > 0 ? m_buf.rfind('\n', room - 1) : std::string::npos;
+            if(lineEnd != std::string::npos)
+                len = lineEnd + 1;
+            else
+                len = m_logSize == 0 ? room : 0;
+            full = true;
+        }
+
+        size_t done = 0;
+        while(done < len)
+        {
+            ssize_t ret = write(m_log.get(), m_buf.data() + done, len - done);
+            if(ret < 0 && errno == EINTR)
+                continue;
+            if(ret <= 0)
+                break;
+            done += ret;
+        }
+        m_buf.erase(0, done);
+        m_logSize += done;
+        m_spec->m_bytesWritten += done;
+        if(done < len)
+            return false;
+        if(full && !rotate())
+            return false;
+    }
+    return true;
+}
+
+// returns false, with the file left as it was, if it couldn't be moved
+// aside: reopening it would only find it still full
+bool LogSinkPump::rotate()
+{
+    const std::string &path = m_spec->m_path;
+    for(int i = m_spec->m_keep - 1; i >= 0; --i)
+    {
+        char from[32] = "", to[32];
+        if(i > 0)
+            snprintf(from, sizeof(from), ".%d", i);
+        snprintf(to, sizeof(to), ".%d", i + 1);
+        // files which aren't there (yet) are fine
+        if(rename((path + from).c_str(), (path + to).c_str()) != 0 && errno != ENOENT)
+            return false;
+    }
+    m_log.reset();
+    ++m_spec->m_rotations;
+    // with nothing to keep, the file just starts again. If it can't be
+    // opened, flush() tries again.
+    openLog(m_spec->m_keep > 0 ? 0 : O_TRUNC);
+    return true;
+}
+
+bool LogSinkPump::openLog(int flags)
+{
+    m_log.reset(::open(m_spec->m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0666));
+    struct stat st;
+    if(!m_log.isOk() || fstat(m_log.get(), &st) != 0)
+    {
+        int err = errno;
+        m_log.reset();
+        errno = err;
+        return false;
+    }
+    m_logSize = st.st_size;
+    m_openedAt = monotonicSeconds();
+    return true;
+}
+
+// once the writers are gone, writes out what's left of the buffer. This is
+// called from the epoll loop, so it never waits: a full disk or a shortage
+// of fds can clear up, and until then the timer tries again. Any other error
+// is reported rather than the output quietly dropped.
+void LogSinkPump::drain()
+{
+    if(flush())
+    {
+        finish();
+        return;
+    }
+    if(errno == EINTR || errno == EAGAIN || errno == ENOSPC || errno == EDQUOT
+            || errno == EMFILE || errno == ENFILE)
+    {
+        // no need to wait out flush_ms to try again
+        struct itimerspec its = {};
+        its.it_interval.tv_nsec = LOG_SINK_RETRY_MS * 1000000L;
+        its.it_value = its.it_interval;
+        CHECK(timerfd_settime(m_timer.get(), 0, &its, NULL) == 0, "timerfd_settime failed: %m");
+        return;
+    }
+    int err = errno;
+    size_t lost = m_buf.size();
+    finish();
+    errno = err;
+    throw failure("write to %s failed, losing %zu bytes: %m", m_spec->m_path.c_str(), lost);
+}
+
+void LogSinkPump::finish()
+{
+    m_buf.clear();
+    watch(m_timer.get(), 0);
+    m_timer.reset();
+    m_log.reset();
+}
+
+void LogSinkPump::updateWatches()
+{
+    // a full buffer has to be written out before there's any more reading.
+    // A hangup is reported regardless of the events, so stop watching.
+    watch(m_input->get(), m_buf.size() < LOG_SINK_MAX_BUFFER ? uint32_t(EPOLLIN) : uint32_t(0));
+}
+
+#ifndef SYS_pidfd_getfd // linux 5.6
+#define SYS_pidfd_getfd 438
+#endif
+#define PIPE_SIZER_INTERVAL_MS 25
+#define PIPE_SIZER_FULL_SAMPLES 4
+
+PipeSizer::PipeSizer()
+{
+    m_timer.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    CHECK(m_timer.isOk(), "timerfd_create failed: %m");
+}
+
+void PipeSizer::addPipe(const file_spec_ptr &spec, const FD &fd, const std::vector<daemon_pipe::Proc *> &readers)
+{
+    struct stat st;
+    CHECK(fstat(fd.get(), &st) == 0, "fstat of pipe failed: %m");
+    Link link;
+    link.m_spec = spec;
+    link.m_dev = st.st_dev;
+    link.m_ino = st.st_ino;
+    link.m_readers = readers;
+    link.m_fullSamples = 0;
+    m_links.push_back(link);
+}
+
+void PipeSizer::start()
+{
+    struct itimerspec its = {};
+    its.it_interval.tv_nsec = PIPE_SIZER_INTERVAL_MS * 1000000L;
+    its.it_value = its.it_interval;
+    CHECK(timerfd_settime(m_timer.get(), 0, &its, NULL) == 0, "timerfd_settime failed: %m");
+    watch(m_timer.get(), EPOLLIN);
+}
+
+void PipeSizer::ready(int, uint32_t)
+{
+    uint64_t expirations;
+    ssize_t ret = read(m_timer.get(), &expirations, sizeof(expirations));
+    (void)ret;
+    for(std::vector<Link>::iterator link = m_links.begin(), end = m_links.end(); link != end; ++link)
+        sample(*link);
+    if(finished())
+    {
+        watch(m_timer.get(), 0);
+        m_timer.reset();
+    }
+}
+
+// done once no pipe has a reader left to look at it through
+bool PipeSizer::finished() const
+{
+    for(std::vector<Link>::const_iterator link = m_links.begin(), end = m_links.end(); link != end; ++link)
+    {
+        for(std::vector<daemon_pipe::Proc *>::const_iterator r = link->m_readers.begin(), rend = link->m_readers.end();
+                r != rend; ++r)
+        {
+            if((*r)->m_spec->running())
+                return false;
+        }
+    }
+    return true;
+}
+
+void PipeSizer::sample(Link &link)
+{
+    const int maxSize = pipeMaxSize();
+    if(link.m_spec->m_actualPipeSize >= maxSize)
+        return;
+
+    FD fd;
+    for(std::vector<daemon_pipe::Proc *>::const_iterator r = link.m_readers.begin(), end = link.m_readers.end();
+            r != end && !fd.isOk(); ++r)
+    {
+        if((*r)->m_spec->running() && (*r)->m_pidfd.isOk())
+            fd.reset(syscall(SYS_pidfd_getfd, (*r)->m_pidfd.get(), STDIN_FILENO, 0));
+    }
+    // the reader may have swapped its stdin for something else
+    struct stat st;
+    if(!fd.isOk() || fstat(fd.get(), &st) != 0 || st.st_dev != link.m_dev || st.st_ino != link.m_ino)
+        return;
+
+    int used = 0, size = fcntl(fd.get(), F_GETPIPE_SZ);
+    if(size <= 0 || ioctl(fd.get(), FIONREAD, &used) != 0)
+        return;
+    link.m_spec->m_actualPipeSize = size;
+    if(used < size / 4 * 3)
+    {
+        link.m_fullSamples = 0;
+        return;
+    }
+    if(++link.m_fullSamples < PIPE_SIZER_FULL_SAMPLES)
+        return;
+
+    link.m_fullSamples = 0;
+    int newSize = fcntl(fd.get(), F_SETPIPE_SZ, std::min(size * 2, maxSize));
+    if(newSize > 0)
+        link.m_spec->m_actualPipeSize = newSize;
+}
@@ -0,0 +1,193 @@
+#ifndef WITH_PUMP_H
+#define WITH_PUMP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pipe.hpp"
+
+class PumpSet;
+
+/// Something in the daemon_pipe parent that moves data between fds while the
+/// children run. Pumps are driven by the epoll loop of their PumpSet, so they
+/// must never block.
+class Pump : public boost::noncopyable
+{
+public:
+    Pump() : m_set(NULL) {}
+    virtual ~Pump() {}
+
+    /// called once the pump belongs to a PumpSet; registers the fds it wants
+    virtual void start() = 0;
+    /// fd, which the pump watched, has events ready
+    virtual void ready(int fd, uint32_t events) = 0;
+    /// true once the pump has nothing left to do and has closed its fds
+    virtual bool finished() const = 0;
+
+protected:
+    /// sets the epoll events the pump wants on fd; 0 stops watching it,
+    /// which must happen before fd is closed
+    void watch(int fd, uint32_t events);
+
+private:
+    PumpSet *m_set;
+    friend class PumpSet;
+};
+
+/// The pumps of one daemon_pipe run. Its epoll fd goes into the epoll set of
+/// the ProcHarvester, so the pumps run from the loop which reaps the children.
+class PumpSet : public boost::noncopyable
+{
+public:
+    PumpSet();
+    ~PumpSet();
+
+    /// takes ownership of pump and starts it
+    void add(Pump *pump);
+    /// true while any pump hasn't finished
+    bool active() const;
+    int fd() const { return m_epoll.get(); }
+    /// lets every pump with a ready fd run, without waiting
+    void run();
+
+private:
+    void watch(Pump *pump, int fd, uint32_t events);
+
+    typedef std::map<int, std::pair<Pump *, uint32_t> > WatchMap;
+    FD m_epoll;
+    WatchMap m_watched;
+    std::vector<Pump *> m_pumps;
+
+    friend class Pump;
+};
+
+/// dp:tee(n): copies everything written into its input pipe into the pipes
+/// of its readers. The copies are made with tee(2), which only takes a
+/// reference on the pipe's pages, and the input is consumed with splice(2),
+/// so as long as every reader keeps up, no data passes through userspace.
+///
+/// A reader which can't take a whole chunk is handled by the tee's policy:
+///   TEE_BLOCK: the rest of the chunk is kept for it, and nothing more is
+///              read from the input until it has taken it. The writer stalls
+///              like it would on a full pipe.
+///   TEE_DROP:  the rest of the chunk is thrown away for that reader.
+///   TEE_SPILL: it is appended to an unlinked file in $TMPDIR for that
+///              reader, which is fed from the file until it has caught up.
+///              The other readers carry on at their own pace.
+/// A reader that goes away is dropped; if they all do, the input is closed.
+class TeePump : public Pump
+{
+public:
+    TeePump(const FDPtr &input, const std::vector<FDPtr> &outputs, file_spec::tee_policy policy);
+
+    void start();
+    void ready(int fd, uint32_t events);
+    bool finished() const { return !m_input->isOk() && m_live == 0; }
+
+private:
+    struct Branch
+    {
+        Branch() : m_spillRead(0), m_spillWrite(0) {}
+        bool behind() const { return !m_backlog.empty() || m_spillRead != m_spillWrite; }
+
+        FDPtr m_fd;
+        std::string m_backlog;      // TEE_BLOCK
+        FDPtr m_spill;              // TEE_SPILL
+        loff_t m_spillRead, m_spillWrite;
+    };
+
+    void pumpInput(uint32_t events);
+    void keep(Branch &branch, const char *buf, size_t len);
+    void drain(Branch &branch);
+    void closeBranch(Branch &branch);
+    void closeInput();
+    void updateWatches();
+
+    FDPtr m_input;
+    FD m_devnull;
+    std::vector<Branch> m_branches;
+    size_t m_live; // branches whose reader is still there
+    file_spec::tee_policy m_policy;
+    std::vector<char> m_buf;
+};
+
+/// dp:log_sink: reads its pipe as fast as it's written and appends it to a
+/// log file, so the writers never wait on the disk or on a logger process.
+///
+/// Output is buffered until there's a good amount of it, or it has waited
+/// flush_ms. Before the file grows past max_bytes, it's rotated at the last
+/// whole line which fits: path.<keep-1> becomes path.<keep> and so on, and
+/// path becomes path.1. It's also rotated once it's rotate_secs old.
+///
+/// If the file can't be written, output stays in the buffer and the write is
+/// retried when the timer fires. Once the buffer is full, the pipe isn't
+/// read until it has been written out. When the writers are gone, the sink
+/// only finishes once the rest of the buffer is written out, retrying on the
+/// timer through a full disk, or an error it can't get past is reported.
+class LogSinkPump : public Pump
+{
+public:
+    LogSinkPump(const FDPtr &input, const log_sink_spec_ptr &spec);
+
+    void start();
+    void ready(int fd, uint32_t events);
+    bool finished() const { return !m_input->isOk() && !m_timer.isOk(); }
+
+private:
+    void readInput();
+    bool flush();
+    bool rotate();
+    bool openLog(int flags);
+    void drain();
+    void finish();
+    void updateWatches();
+
+    FDPtr m_input;
+    log_sink_spec_ptr m_spec;
+    FD m_log, m_timer;
+    std::string m_buf;
+    unsigned long long m_logSize;
+    time_t m_openedAt; // CLOCK_MONOTONIC
+};
+
+/// Grows the buffers of adaptive pipes, dp:pipe(size, true), which keep
+/// filling up, so a fast writer spends less time waiting on its reader.
+///
+/// The pipes are sampled on a timer, and one that is at least 3/4 full on
+/// PIPE_SIZER_FULL_SAMPLES samples in a row gets its buffer doubled, up to
+/// pipe-max-size. We can't hold on to either end of a pipe ourselves without
+/// keeping its readers from seeing EOF or its writers from seeing EPIPE, so
+/// each sample borrows a running reader's stdin with pidfd_getfd (linux 5.6).
+/// On older kernels the pipes keep their starting size.
+class PipeSizer : public Pump
+{
+public:
+    PipeSizer();
+
+    /// fd is the parent's end of spec's pipe, which is only used to identify it
+    void addPipe(const file_spec_ptr &spec, const FD &fd, const std::vector<daemon_pipe::Proc *> &readers);
+
+    void start();
+    void ready(int fd, uint32_t events);
+    bool finished() const;
+
+private:
+    struct Link
+    {
+        file_spec_ptr m_spec;
+        dev_t m_dev;
+        ino_t m_ino;
+        std::vector<daemon_pipe::Proc *> m_readers;
+        int m_fullSamples;
+    };
+
+    void sample(Link &link);
+
+    FD m_timer;
+    std::vector<Link> m_links;
+};
+
+#endif // WITH_PUMP_H
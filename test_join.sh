@@ -0,0 +1,99 @@
+#!/bin/sh
+# Checks that a setuid exec_with_namespace --join only enters namespaces it
+# built itself. An unprivileged user can make a mount namespace in a user
+# namespace of their own that looks just like a with namespace (a tmpfs on
+# /with holding a .ns), with anything they like mounted over /etc; joining
+# that as root would let them feed setuid programs files of their choosing.
+#
+# usage: test_join.sh [helper]   (default ./exec_with_namespace)
+# Needs root, to make a setuid copy of the helper and a private /with to
+# run it against. The tests run as TEST_UID (default 65534).
+
+HELPER=${1:-./exec_with_namespace}
+TEST_UID=${TEST_UID:-65534}
+
+if [ "$(id -u)" != 0 ]; then
+    echo "test_join: skipped, needs root"
+    exit 0
+fi
+if ! unshare -Urm true 2>/dev/null; then
+    echo "test_join: skipped, no unprivileged user namespaces"
+    exit 0
+fi
+
+# everything below happens in a mount namespace of our own, with a fresh
+# tmpfs on /with just like the init script makes
+if [ -z "$TEST_JOIN_INSIDE" ]; then
+    [ -d /with ] || mkdir /with || exit 1
+    TEST_JOIN_INSIDE=1 exec unshare -m --propagation private "$0" "$@"
+fi
+mount -t tmpfs with-global /with || exit 1
+
+dir=$(mktemp -d /tmp/test_join.XXXXXX) || exit 1
+mount -t tmpfs -o mode=0755 test-join "$dir" || exit 1
+trap 'kill $pids 2>/dev/null; umount -l "$dir"; rmdir "$dir"' EXIT
+cp "$HELPER" "$dir/exec_with_namespace" && chmod 4755 "$dir/exec_with_namespace" || exit 1
+chmod 0777 "$dir"
+suid=$dir/exec_with_namespace
+pids=
+# somewhere the user can chdir to, which --join wants to stay in
+cd /
+
+as_user()
+{
+    setpriv --reuid="$TEST_UID" --regid="$TEST_UID" --clear-groups -- "$@"
+}
+
+# waits for the file $1 to hold a pid, and prints it
+wait_for_pid()
+{
+    i=0
+    while [ ! -s "$1" ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    cat "$1"
+}
+
+failures=0
+check()
+{
+    if [ "$1" = 0 ]; then
+        echo "ok: $2"
+    else
+        echo "FAIL: $2"
+        failures=$((failures + 1))
+    fi
+}
+
+# a namespace the helper built for the user can be joined
+as_user "$suid" sh -c 'echo $$ > '"$dir"'/built.pid; exec sleep 30' -- test-dev a=/tmp -- PATH=/bin:/usr/bin &
+pids="$pids $!"
+pid=$(wait_for_pid "$dir/built.pid")
+out=$(as_user "$suid" --join="$pid" cat /with/.ns -- PATH=/bin:/usr/bin 2>&1)
+[ "$out" = "test-dev a=/tmp " ]
+check $? "joining a namespace the helper built"
+
+# a look-alike built in the user's own user namespace can't be, even though
+# it has a tmpfs on /with with a .ns in it
+as_user unshare -Urm sh -c 'mount -t tmpfs evil /with && touch /with/.ns \
+    && mount -t tmpfs evil /etc && echo crafted > /etc/passwd \
+    && echo $$ > '"$dir"'/crafted.pid && exec sleep 30' &
+pids="$pids $!"
+pid=$(wait_for_pid "$dir/crafted.pid")
+out=$(as_user "$suid" --join="$pid" cat /etc/passwd -- PATH=/bin:/usr/bin 2>&1)
+ret=$?
+[ $ret != 0 ] && ! echo "$out" | grep -q crafted && echo "$out" | grep -q "refusing to join"
+check $? "joining a namespace from another user namespace is refused"
+
+# and neither can a process in our user namespace whose /with has a .ns
+# the user wrote
+as_user sh -c 'echo $$ > '"$dir"'/plain.pid; exec sleep 30' &
+pids="$pids $!"
+pid=$(wait_for_pid "$dir/plain.pid")
+touch /with/.ns && chown "$TEST_UID" /with/.ns
+out=$(as_user "$suid" --join="$pid" true -- PATH=/bin:/usr/bin 2>&1)
+[ $? != 0 ] && echo "$out" | grep -q "not in a with namespace"
+check $? "joining a namespace whose .ns root didn't write is refused"
+
+[ $failures = 0 ]
@@ -0,0 +1,436 @@
+// Checks what daemon_pipe does with real processes.
+//
+// usage: test_pipe
+// The full disk and cgroup checks need root, and the cgroup ones a cgroup
+// v2 hierarchy we can make cgroups in; they're skipped without. They run in
+// a mount namespace of their own, so that they can mount a small tmpfs, and
+// take cgroup.kill away.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "cgroup.hpp"
+#include "pipe.hpp"
+
+static int failures = 0;
+static std::string tmpdir;
+
+static void check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if(!ok)
+        ++failures;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::string tmpfile(const char *name)
+{
+    return tmpdir + "/" + name;
+}
+
+static std::string readFile(const std::string &path)
+{
+    std::string data;
+    FILE *f = fopen(path.c_str(), "re");
+    if(!f)
+        return data;
+    char buf[65536];
+    size_t len;
+    while((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, len);
+    fclose(f);
+    return data;
+}
+
+// a proc running script with sh; args become $0, $1...
+static daemon_proc_spec_ptr shell(daemon_pipe &dp, const char *script,
+                                  const std::string &arg0 = "sh", const std::string &arg1 = "")
+{
+    daemon_proc_spec_ptr proc(new daemon_proc_spec);
+    proc->m_cmdArgv.push_back("/bin/sh");
+    proc->m_cmdArgv.push_back("-c");
+    proc->m_cmdArgv.push_back(script);
+    proc->m_cmdArgv.push_back(arg0);
+    if(!arg1.empty())
+        proc->m_cmdArgv.push_back(arg1);
+    dp.add_proc(proc);
+    return proc;
+}
+
+// every reader of a tee gets everything; with "spill" and "drop" a slow one
+// doesn't hold the writer up, and with "drop" it misses what it couldn't take
+static void testTee(file_spec::tee_policy policy, const char *name)
+{
+    const int total = 4000000;
+    daemon_pipe dp;
+    file_spec_ptr tee = dp.add_tee(2, policy);
+    daemon_proc_spec_ptr writer = shell(dp, "exec head -c 4000000 /dev/zero");
+    writer->m_stdout = tee;
+    daemon_proc_spec_ptr fast = shell(dp, "exec wc -c");
+    fast->m_stdin = tee;
+    fast->m_stdout = dp.add_file(tmpfile("fast"));
+    daemon_proc_spec_ptr slow = shell(dp, "sleep 1; exec wc -c");
+    slow->m_stdin = tee;
+    slow->m_stdout = dp.add_file(tmpfile("slow"));
+    dp.exec();
+
+    int fastBytes = atoi(readFile(tmpfile("fast")).c_str());
+    int slowBytes = atoi(readFile(tmpfile("slow")).c_str());
+    char what[128];
+    if(policy == file_spec::TEE_DROP)
+    {
+        // even the fast reader may miss a little, whenever its pipe was
+        // full just as more came
+        snprintf(what, sizeof(what), "tee %s: the slow reader misses what it couldn't take", name);
+        check(slowBytes < total && slowBytes < fastBytes, what);
+    }
+    else
+    {
+        snprintf(what, sizeof(what), "tee %s: the fast reader gets everything", name);
+        check(fastBytes == total, what);
+        snprintf(what, sizeof(what), "tee %s: the slow reader gets everything", name);
+        check(slowBytes == total, what);
+    }
+    if(policy == file_spec::TEE_BLOCK)
+    {
+        snprintf(what, sizeof(what), "tee %s: the writer waits for the slow reader", name);
+        check(writer->m_wallTime >= 0.9, what);
+    }
+    else
+    {
+        snprintf(what, sizeof(what), "tee %s: the writer doesn't wait for the slow reader", name);
+        check(writer->m_wallTime < 0.9, what);
+    }
+}
+
+// output is rotated at line breaks before a file outgrows max_bytes, and
+// none of it is lost or reordered on the way
+static void testLogSinkRotation()
+{
+    log_sink_spec_ptr spec(new log_sink_spec);
+    spec->m_path = tmpfile("rotated.log");
+    spec->m_maxBytes = 10000;
+    spec->m_keep = 10;
+    spec->m_flushMS = 0;
+    daemon_pipe dp;
+    file_spec_ptr sink = dp.add_log_sink(spec);
+    daemon_proc_spec_ptr writer = shell(dp, "exec seq -f 'line %05g ..........' 1 2000");
+    writer->m_stdout = sink;
+    daemon_proc_spec_ptr expected = shell(dp, "exec seq -f 'line %05g ..........' 1 2000");
+    expected->m_stdout = dp.add_file(tmpfile("expected.log"));
+    dp.exec();
+
+    std::string all;
+    bool withinLimit = true;
+    for(int i = spec->m_keep; i >= 0; --i)
+    {
+        char suffix[16] = "";
+        if(i > 0)
+            snprintf(suffix, sizeof(suffix), ".%d", i);
+        std::string data = readFile(spec->m_path + suffix);
+        if(data.size() > spec->m_maxBytes || (!data.empty() && data[data.size() - 1] != '\n'))
+            withinLimit = false;
+        all += data;
+    }
+    std::string want = readFile(tmpfile("expected.log"));
+    check(all == want && !want.empty(), "log sink: the rotated files hold all the output, in order");
+    check(withinLimit, "log sink: each file is within max_bytes and ends at a line break");
+    check(spec->m_rotations >= 4, "log sink: the file is rotated as it fills up");
+    check(spec->m_bytesWritten == want.size(), "log sink: bytes_written counts the output");
+}
+
+// a file which can't be rotated stops the sink, with an error, rather than
+// being reopened and rotated again forever
+static void testLogSinkStuckRotation()
+{
+    log_sink_spec_ptr spec(new log_sink_spec);
+    spec->m_path = tmpfile("stuck.log");
+    spec->m_maxBytes = 100;
+    spec->m_keep = 1;
+    spec->m_flushMS = 0;
+    std::string inTheWay = spec->m_path + ".1";
+    mkdir(inTheWay.c_str(), 0755);
+    close(open((inTheWay + "/file").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    daemon_pipe dp;
+    shell(dp, "exec seq 1 1000")->m_stdout = dp.add_log_sink(spec);
+    bool failed = false;
+    try
+    {
+        dp.exec();
+    }
+    catch(failure &)
+    {
+        failed = true;
+    }
+    check(failed && spec->m_rotations == 0, "log sink: a rotation that can't be done is reported");
+    check(readFile(spec->m_path).size() <= 100, "log sink: the file isn't written past max_bytes meanwhile");
+}
+
+// what's still buffered when the writers go is written out, however long
+// flush_ms is
+static void testLogSinkFinish()
+{
+    log_sink_spec_ptr spec(new log_sink_spec);
+    spec->m_path = tmpfile("finish.log");
+    spec->m_flushMS = 60000;
+    daemon_pipe dp;
+    shell(dp, "echo hello; echo world")->m_stdout = dp.add_log_sink(spec);
+    double start = now();
+    dp.exec();
+    check(readFile(spec->m_path) == "hello\nworld\n", "log sink: the buffer is written out when the writers go");
+    check(now() - start < 30, "log sink: finishing doesn't wait for flush_ms");
+}
+
+// a log sink on a full disk keeps its output without holding up the
+// pipeline's loop, and writes it out once there's room
+static void testLogSinkFullDisk()
+{
+    std::string disk = tmpfile("disk");
+    if(mkdir(disk.c_str(), 0755) != 0 || mount("test-pipe", disk.c_str(), "tmpfs", 0, "size=64k") != 0)
+    {
+        perror("test_pipe: mounting a small tmpfs");
+        ++failures;
+        return;
+    }
+    std::string filler = disk + "/filler";
+    std::string fill = "dd if=/dev/zero of=" + filler + " bs=4k 2>/dev/null";
+    if(system(fill.c_str()) == 0)
+        fprintf(stderr, "test_pipe: %s didn't fill up\n", disk.c_str());
+
+    log_sink_spec_ptr spec(new log_sink_spec);
+    spec->m_path = disk + "/full.log";
+    spec->m_flushMS = 0;
+    daemon_pipe dp;
+    shell(dp, "echo hello")->m_stdout = dp.add_log_sink(spec);
+    dp.start();
+    double start = now();
+    bool done = false;
+    for(int i = 0; i < 5 && !done; ++i)
+        done = dp.poll(100);
+    check(!done && now() - start < 2, "log sink: a full disk doesn't hold up poll()");
+
+    unlink(filler.c_str());
+    dp.wait();
+    check(readFile(spec->m_path) == "hello\n", "log sink: the output is written once there's room");
+    umount2(disk.c_str(), MNT_DETACH);
+}
+
+// an adaptive pipe which stays full grows
+static void testAdaptivePipe()
+{
+    daemon_pipe dp;
+    file_spec_ptr pipe = dp.add_pipe(0, true);
+    shell(dp, "exec head -c 20000000 /dev/zero")->m_stdout = pipe;
+    shell(dp, "sleep 1; exec cat > /dev/null")->m_stdin = pipe;
+    dp.exec();
+    check(pipe->m_actualPipeSize > 65536, "adaptive pipe: a pipe that stays full is grown");
+
+    daemon_pipe fixed;
+    file_spec_ptr fixedPipe = fixed.add_pipe(0, false);
+    shell(fixed, "exec head -c 20000000 /dev/zero")->m_stdout = fixedPipe;
+    shell(fixed, "sleep 1; exec cat > /dev/null")->m_stdin = fixedPipe;
+    fixed.exec();
+    check(fixedPipe->m_actualPipeSize == 65536, "adaptive pipe: one that isn't adaptive keeps its size");
+}
+
+// a proc which keeps failing is restarted with a doubling wait, until it
+// has been restarted max_restarts_per_min times in a minute
+static void testRestartBackoff()
+{
+    daemon_pipe dp;
+    daemon_proc_spec_ptr proc = shell(dp, "echo run >> \"$0\"; exit 3", tmpfile("runs"));
+    proc->m_restart = daemon_proc_spec::RESTART_ON_FAILURE;
+    proc->m_backoffMinMS = 50;
+    proc->m_backoffMaxMS = 200;
+    proc->m_maxRestartsPerMin = 5;
+    double start = now();
+    dp.exec();
+    double took = now() - start;
+
+    std::string runs = readFile(tmpfile("runs"));
+    check(proc->m_restarts == 5 && runs.size() == 6 * strlen("run\n"), "restart: a failing proc is restarted up to the limit");
+    check(proc->m_crashLooping, "restart: then it counts as crash looping");
+    check(WIFEXITED(proc->getStatus()) && WEXITSTATUS(proc->getStatus()) == 3, "restart: its last status is kept");
+    // 50 + 100 + 200 + 200 + 200
+    check(took >= 0.75, "restart: the wait doubles up to backoff max");
+    check(took < 5, "restart: the wait doesn't grow past backoff max");
+
+    daemon_pipe clean;
+    daemon_proc_spec_ptr ok = shell(clean, "exit 0");
+    ok->m_restart = daemon_proc_spec::RESTART_ON_FAILURE;
+    clean.exec();
+    check(ok->m_restarts == 0 && !ok->m_crashLooping, "restart: on_failure leaves a proc which succeeded");
+}
+
+// whether pid has gone, waiting a little for a SIGKILL to land
+static bool gone(int pid)
+{
+    for(int i = 0; i < 50; ++i)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        std::string stat = readFile(path);
+        const char *state = strrchr(stat.c_str(), ')');
+        if(stat.empty() || (state && state[1] == ' ' && state[2] == 'Z'))
+            return true;
+        usleep(100000);
+    }
+    return false;
+}
+
+// mounts a read-only bind of from over to
+static int mountReadOnly(const std::string &from, const std::string &to)
+{
+    if(mount(from.c_str(), to.c_str(), NULL, MS_BIND, NULL) != 0)
+        return -1;
+    return mount(NULL, to.c_str(), NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL);
+}
+
+// the proc starts a process in a cgroup it makes below the pipeline's, out
+// of reach of signals to the proc itself; killing the pipeline gets it too.
+// Without cgroup.kill (before linux 5.14) that takes walking the child
+// cgroups, which the second run forces by mounting a read-only file over it.
+static void testCgroupKill(const std::string &mount, bool withCgroupKill)
+{
+    // $0 is the cgroup2 mount, $1 where to say what happened
+    const char *script =
+        "cg=$0$(sed -n 's/^0:://p' /proc/self/cgroup)\n"
+        "echo \"$cg\" > \"$1.cgroup\"\n"
+        "mkdir \"$cg/nested\" || exit 1\n"
+        "sh -c 'echo $$ > \"$0/cgroup.procs\" && echo $$ > \"$1.tmp\" && mv \"$1.tmp\" \"$1\" && exec sleep 1000' \"$cg/nested\" \"$1\" &\n"
+        "exec sleep 1000\n";
+    std::string report = tmpfile(withCgroupKill ? "killed" : "walked");
+    daemon_pipe dp;
+    dp.m_cgroup.reset(new cgroup_spec);
+    // nothing left over should hold on to our stdout
+    daemon_proc_spec_ptr proc = shell(dp, script, mount, report);
+    proc->m_stdout = proc->m_stderr = dp.get_devnull();
+    dp.start();
+    for(int i = 0; i < 50 && access(report.c_str(), F_OK) != 0; ++i)
+        dp.poll(100);
+    int pid = atoi(readFile(report).c_str());
+    std::string cg = readFile(report + ".cgroup");
+    cg.erase(cg.find_last_not_of('\n') + 1);
+
+    std::string readOnly = tmpfile("readonly"), cgroupKill = cg + "/cgroup.kill";
+    if(!withCgroupKill)
+    {
+        close(open(readOnly.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+        if(mountReadOnly(readOnly, cgroupKill) != 0)
+        {
+            perror("test_pipe: mounting over cgroup.kill");
+            ++failures;
+        }
+    }
+    dp.kill_all();
+    dp.wait();
+    if(!withCgroupKill)
+        umount2(cgroupKill.c_str(), MNT_DETACH);
+
+    bool killed = pid > 0 && gone(pid);
+    check(killed, withCgroupKill
+        ? "cgroup kill: a process in a child cgroup is killed with cgroup.kill"
+        : "cgroup kill: a process in a child cgroup is killed without cgroup.kill");
+    if(pid > 0 && !killed)
+    {
+        kill(pid, SIGKILL);
+        gone(pid);
+    }
+    rmdir((cg + "/nested").c_str());
+    rmdir(cg.c_str());
+}
+
+// the cgroup2 mount, if we can make cgroups in it, or empty
+static std::string cgroupMount()
+{
+    if(geteuid() != 0)
+        return "";
+    std::string own;
+    try
+    {
+        own = Cgroup::ownCgroup();
+    }
+    catch(failure &)
+    {
+        return "";
+    }
+    std::string probe = own + "/test_pipe-probe";
+    if(mkdir(probe.c_str(), 0755) != 0)
+        return "";
+    rmdir(probe.c_str());
+
+    // own is the mount followed by our place in it, from "0::/path"
+    std::string cgroup = readFile("/proc/self/cgroup");
+    size_t at = cgroup.find("0::");
+    if(at == std::string::npos)
+        return "";
+    std::string path = cgroup.substr(at + 3, cgroup.find('\n', at) - at - 3);
+    return path == "/" ? own : own.substr(0, own.size() - path.size());
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_pipe.XXXXXX";
+    if(!mkdtemp(dir))
+    {
+        perror("test_pipe: mkdtemp");
+        return 1;
+    }
+    tmpdir = dir;
+
+    try
+    {
+        testTee(file_spec::TEE_BLOCK, "block");
+        testTee(file_spec::TEE_SPILL, "spill");
+        testTee(file_spec::TEE_DROP, "drop");
+        testLogSinkRotation();
+        testLogSinkFinish();
+        testLogSinkStuckRotation();
+        testAdaptivePipe();
+        testRestartBackoff();
+
+        // the rest mount things, in a mount namespace of our own
+        if(geteuid() != 0 || unshare(CLONE_NEWNS) != 0 || ::mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0)
+        {
+            printf("test_pipe: full disk and cgroup checks skipped, needs root\n");
+        }
+        else
+        {
+            testLogSinkFullDisk();
+            std::string mount = cgroupMount();
+            if(mount.empty())
+                printf("test_pipe: cgroup checks skipped, needs a cgroup v2 hierarchy\n");
+            else
+            {
+                testCgroupKill(mount, true);
+                testCgroupKill(mount, false);
+            }
+        }
+    }
+    catch(failure &f)
+    {
+        fprintf(stderr, "test_pipe: %s\n", f.what());
+        ++failures;
+    }
+
+    std::string cleanup = "rm -rf " + tmpdir;
+    if(system(cleanup.c_str()) != 0)
+        fprintf(stderr, "test_pipe: couldn't remove %s\n", tmpdir.c_str());
+    return failures == 0 ? 0 : 1;
+}
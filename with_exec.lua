@@ -34,36 +34,20 @@ function file_exists(path)
     end
 end
 
-function show_directory(directory)
-    local files = posix.files(directory)
-    local ret = {}
-
-    -- Check that we can inspect the contents of the directory
-    if not files then
-        errstr, errno = posix.errno()
-        error("opendir " .. directory .. " failed: " .. errstr)
-    end
+-- show_directory(directory) returns the symlinks under directory as a
+-- table of { from = name, to = target } sorted by name. For a subdirectory,
+-- to is another such table; for anything else it's nil.
+show_directory = with_exec_c.show_directory
 
-    -- Iterate over the files.  If the file is a symlink, add the from-to
-    -- relationship.  If the file is a directory, then we want to recurse into
-    -- that directory and expose the symlinks in that directory.
-    for file in files do
-        if file ~= '.' and file ~= '..' then
-            local fpath = directory .. "/" .. file
-            local ftype = posix.stat(fpath)['type']
-            if ftype == "directory" then
-                table.insert(ret, { from = file,  to = show_directory(fpath) })
-            elseif ftype == "link" then
-                table.insert(ret, { from = file,  to = posix.readlink(fpath) })
-            else
-                table.insert(ret, { from = file,  to = nil })
-            end
-        end
-    end
+-- file_identity(path) is a string which changes whenever the file at path
+-- (after following symlinks) does, or nil if there's no such file.
+file_identity = with_exec_c.file_identity
 
-    table.sort(ret, function (a, b) return a.from < b.from; end)
-    return ret
-end
+-- With WITH_TRACE set, trace(name, start) records the phase name, which
+-- began at the trace_now() time start, in the trace file (see
+-- exec_trace.hpp). Without it, trace does nothing.
+trace_now = with_exec_c.trace_now
+trace = with_exec_c.trace
 
 -- with_exec.execp is a wrapper around execvp(3)
 -- Wraps a version incompat:
@@ -154,12 +138,14 @@ function exec(args)
             devname = "with-" .. getpid()
         end
 
+        local start = trace_now()
         local namespace_t = table_to_withexec_argv(namespace)
         if exec_cmd then
             for _, v in ipairs(exec_cmd) do
                 namespace_t[#namespace_t + 1] = v
             end
         end
+        trace("flatten namespace", start)
 
         if dry_run then
             return string.format("with_exec.exec{ devname=%q, targets='%s', cmd='%s' }",
@@ -178,6 +164,41 @@ function exec(args)
     end
 end
 
+-- Runs a command in the namespace of an existing process, rather than a
+-- new one built from the same targets. The argument is a table with:
+--
+--   pid:     the process, which must be one of ours and be under with
+--
+--   cmd:     the command to run. should be a table of strings.
+--
+--   dry_run: simply return the lua string to execute, instead of executing.
+function join(args)
+    local pid, cmd, dry_run
+    for k,v in pairs(args) do
+        if k == "pid" then
+            pid = tonumber(v)
+        elseif k == "cmd" then
+            cmd = v
+        elseif k == "dry_run" then
+            dry_run = true
+        else
+            error("unrecognized argument " .. k)
+        end
+    end
+
+    if not pid then
+        error("pid must be a number")
+    end
+    if not cmd or #cmd == 0 then
+        error("cmd must be non-empty")
+    end
+
+    if dry_run then
+        return string.format("with_exec.join{ pid = %d, cmd = %s }", pid, quoteStrList(cmd))
+    end
+    with_exec_c.exec_in_namespace_of_internal(pid, cmd)
+end
+
 -- Shows the namespace of an existing process
 --
 -- for from,to in show_namespace(1222) do
@@ -186,9 +207,27 @@ end
 -- end
 --
 -- pid can be "self"
+--
+-- Namespaces made by a recent exec_with_namespace carry a binary index of
+-- their targets in /with/.index, which saves walking the directory. This
+-- shows what the namespace was created with; anything added to /with since
+-- only shows up in namespaces without an index.
 function show_namespace(pid)
     local base_directory = "/proc/" .. pid .. "/root/with"
-    return show_directory(base_directory)
+    return with_exec_c.read_namespace_index(base_directory .. "/.index")
+        or show_directory(base_directory)
+end
+
+-- Lists the mount namespaces which have a /with, as a table of
+--   { ns = <inode of /proc/<pid>/ns/mnt>, devname = <mount name>,
+--     used = <bytes used on the /with tmpfs>, cached = <true if /with is
+--     an overlay on a cached tree, whose size used leaves out>,
+--     pids = { pid, ... } }
+-- sorted by their lowest pid. The namespace the init script set up has the
+-- devname "global". Only processes we're allowed to look at are
+-- included. With threads > 1, /proc is scanned by that many threads.
+function list_namespaces(threads)
+    return with_exec_c.list_namespaces(threads or 1)
 end
 
 -- exec{ ... cmd = with_exec.shell() } will execute a shell.
@@ -249,8 +288,39 @@ end
 -- is similar to ls | grep -v afs.
 --
 -- Input/output tokens:
---   dp:pipe(): returns a token which represents a pipe.
+--   dp:pipe([size[, adaptive]]): returns a token which represents a pipe.
 --             this token can be passed as stdin/stdout/stderr in add_proc
+--             size is the pipe's buffer size in bytes, capped at
+--             /proc/sys/fs/pipe-max-size; 0 or none leaves the default (64k).
+--             If adaptive is true, the buffer is doubled whenever the pipe
+--             has been mostly full for ~100ms, up to pipe-max-size.
+--             token.pipe_size is the size it has, once dp:run() opened it.
+--
+--   dp:tee(n[, policy]): returns a token which represents a pipe with n readers,
+--             each of which gets everything written to it, like piping
+--             through tee(1) but without the extra process. The copies are
+--             made by the calling process with tee(2)/splice(2) while it
+--             waits for the children. exactly n procs must use it as stdin.
+--             policy says what happens when a reader falls behind:
+--               "block" (the default): the writer waits for it
+--               "drop":  the reader misses what it couldn't take
+--               "spill": what it couldn't take is kept in a file in $TMPDIR
+--                        until it catches up; the other readers carry on
+--
+--   dp:log_sink{
+--      path = "/var/log/x.log", -- the log file, appended to
+--      max_bytes = <number>,    -- rotate before the file grows past this, at a line break.
+--                               -- default: never
+--      keep = <number>,         -- rotated files to keep, as path.1 (newest) .. path.<keep>.
+--                               -- default 5; with 0 the file just starts again
+--      flush_ms = <number>,     -- the longest output is buffered before it's written. default 1000
+--      rotate_secs = <number>,  -- also rotate once the file is this old. default: never
+--   }
+--             returns a token which represents a pipe whose output goes to a rotated log file.
+--             the calling process reads it as fast as it's written while it waits for
+--             the children, so unlike piping to a logger there's no extra process and a
+--             slow disk never blocks the writers. It can only be used for writing.
+--             token.bytes_written and token.rotations count what it has done.
 --
 --   file(filename[,append]): returns a token which represents the file
 --                            if append is true, the file will be appended to when writing
@@ -267,6 +337,20 @@ end
 --                               -- process will be forwarded to this child.
 --      cmd = {"cmd","arg1","arg2"} -- Command to run. Will search $PATH
 --      stdin/stdout/stderr=<token>
+--      restart = "no"/"on-failure"/"always" -- start the process again when it
+--                               -- exits (non-zero or signalled, for on-failure)
+--                               -- while the pipeline runs. It gets the same
+--                               -- tokens and rejoins the process group, and its
+--                               -- pipes stay open for the others meanwhile.
+--                               -- Default "no".
+--      backoff = {min=<secs>, max=<secs>} -- the wait before a restart, doubling
+--                               -- from min up to max. It's back to min once the
+--                               -- process has stayed up for max. Default 0.1, 10.
+--      max_restarts_per_min = <n> -- a process which needs more restarts than
+--                               -- this in a minute is left dead. Default 0, no limit.
+--      cgroup = {cpu_max=, memory_max=, io_weight=} -- run the process in a
+--                               -- cgroup of its own inside the pipeline's;
+--                               -- see dp:cgroup{}
 --   }
 --   Adds to the list of processes to run and returns a handle to the process.
 --   Methods on the handle:
@@ -276,11 +360,54 @@ end
 --     proc.WIFSIGNALED
 --     proc.WEXITSTATUS
 --     proc.WTERMSIG     -- see documentation in wait(2)
+--                          -- of the last time it ran, if it was restarted
+--     proc.restarts     -- how many times it has been restarted this run
+--     proc.crash_looping -- true if it was left dead by max_restarts_per_min
+--   and what its last run cost, from wait4(2)'s rusage. nil until it has
+--   finished, except start_time:
+--     proc.start_time, proc.end_time -- seconds since the epoch
+--     proc.wall_time    -- seconds
+--     proc.utime, proc.stime -- user and system CPU seconds, including the
+--                          -- children it waited for
+--     proc.maxrss       -- peak resident set size in KB
+--     proc.nvcsw, proc.nivcsw -- voluntary and involuntary context switches
 --
 --   dp.lock_file: if non-empty, this file will be flock-ed and
 --                 the caller's PID written to it
 --
+--   dp.use_fork: if true, start children with fork()+exec() instead of
+--                posix_spawn(). posix_spawn doesn't copy the caller's page
+--                tables, but it only returns once its child has exec'd, so
+--                the stages are started one after another. With use_fork
+--                every stage is forked before any exec is waited for, so a
+--                long pipeline starts in about the time of one exec; but
+--                each fork costs time in proportion to the caller's
+--                resident set. So use_fork can pay off for a long pipeline
+--                started by a small caller; bench_spawn compares the two.
+--
+--   dp:cgroup{
+--      parent = <path>,      -- the cgroup v2 directory to make the pipeline's
+--                            -- cgroup in. Default: the caller's own cgroup
+--      cpu_max = "<quota> <period>", -- written to cpu.max
+--      memory_max = "<bytes>",       -- written to memory.max, e.g. "512M"
+--      io_weight = <1-10000>,        -- written to io.weight
+--   }
+--     Runs the pipeline in a cgroup of its own, as does any add_proc{cgroup=}.
+--     The processes are started straight into it (with clone3, so posix_spawn
+--     isn't used), and anything they leave running is killed once they have
+--     all exited, and the cgroup removed. A limit needs its controller enabled
+--     in the parent, which cgroup v2 won't do while the parent has processes
+--     of its own; so limits need a parent which has been delegated to the
+--     caller, and a pipeline with per-process cgroups puts every process in
+--     one.
+--
+--   dp:kill(): SIGKILLs all the processes, and in a cgroup everything they
+--     started too, with one write to cgroup.kill. Nothing is restarted after.
+--
 --   dp:run(): runs all the processes and waits for them to finish.
+--     All of them are started before checking that any exec worked. If one
+--     couldn't be started, the rest get SIGTERM, and once they've all exited
+--     the error is raised.
 --     Returns a table of exit statuses, one for time you called add_proc. The keys
 --       {
 --         pid = xxx,
@@ -288,8 +415,26 @@ end
 --         exitstatus = number, -- defined if exited == true, see WEXITSTATUS
 --         signalled = <true/false>,
 --         termsig = number,    -- defined if signalled == true, see WTERMSIG
+--         start_time, end_time, wall_time, utime, stime, maxrss, nvcsw, nivcsw,
+--         restarts,            -- as for the proc handle
+--         stdin_pipe_size, stdout_pipe_size, stderr_pipe_size,
+--                              -- the buffer size of each stream that is a pipe,
+--                              -- as it was when the proc finished; nil otherwise
 --       }
 --
+--   dp:start(): starts all the processes like dp:run(), but returns straight away.
+--     The proc handles' fields are updated as the processes are reaped by:
+--   dp:poll([timeout]): does whatever is waiting to be done (reaping, forwarding
+--     signals, feeding tees and log sinks) for up to timeout seconds, default 0,
+--     negative for as long as it takes. Returns true once everything has exited.
+--   dp:wait(): dp:poll(-1)
+--   dp.fd: while running, an fd which is readable whenever dp:poll() has work to
+--     do, for waiting on many pipelines at once with poll/epoll. nil otherwise.
+--   dp.running: true between dp:start() and the dp:poll() which returns true.
+--   Several pipelines can run at once; a signal is forwarded to the
+--   forward_signals children of all of them. A pipeline that's garbage
+--   collected while it's running waits for its processes first.
+--
 -- The differences from bash's piping:
 --   * A process group will be created for all children. This causes ctrl-z to
 --     not stop the children (only the caller), and ctrl-c to only be sent to
@@ -299,6 +444,7 @@ end
 --
 --   * On receipt of a signal, all children must exit before daemon_pipe
 --     returns. So no processes should be orphaned unless the parent is kill -9'd
+--     Nothing is restarted after a SIGINT/QUIT/TERM, nor after a failed start.
 daemon_pipe = with_exec_c.daemon_pipe
 
 -- try_error_write(bbloggercmd, err) is used to exec a bblogger